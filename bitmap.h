@@ -39,12 +39,14 @@ static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
 {
 	uint32_t ret;
 
+	spin_lock(&sbi->bitmap_lock);
 	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
-	if (ret) {
+	if (ret)
 		sbi->nr_free_inodes--;
+	spin_unlock(&sbi->bitmap_lock);
+	if (ret)
 		pr_debug("%s:%d: allocated inode %u\n",
 			 __func__, __LINE__, ret);
-	}
 	return ret;
 }
 
@@ -56,19 +58,21 @@ static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
 {
 	uint32_t ret;
 
-	int nb_blocs = OUICHEFS_TOTAL_BLOCK(sbi);
-	pr_info("nbtotal:%d needed%d nbleft%d\n",
-		nb_blocs, nb_blocs * PERCENTAGE / 100,sbi->nr_free_blocks);
-	if (nb_blocs * PERCENTAGE / 100 > sbi->nr_free_blocks)
-		ouichefs_fblocks(root_inode);
-
-	
+	spin_lock(&sbi->bitmap_lock);
 	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
-	if (ret) {
+	if (ret)
 		sbi->nr_free_blocks--;
+	/*
+	 * Callers hold page, inode or directory locks: under the watermark,
+	 * files are evicted in the background (see ouichefs_fblocks_kick()).
+	 */
+	if (sbi->nr_free_blocks < OUICHEFS_WATERMARK(sbi) &&
+	    !sbi->watermark_off)
+		ouichefs_fblocks_kick(sbi);
+	spin_unlock(&sbi->bitmap_lock);
+	if (ret)
 		pr_debug("%s:%d: allocated block %u\n",
 			 __func__, __LINE__, ret);
-	}
 	return ret;
 }
 
@@ -92,10 +96,13 @@ static inline int put_free_bit(unsigned long *freemap, unsigned long size,
  */
 static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
+	spin_lock(&sbi->bitmap_lock);
+	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino)) {
+		spin_unlock(&sbi->bitmap_lock);
 		return;
-
+	}
 	sbi->nr_free_inodes++;
+	spin_unlock(&sbi->bitmap_lock);
 	pr_debug("%s:%d: freed inode %u\n",
 		 __func__, __LINE__, ino);
 }
@@ -105,10 +112,13 @@ static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
  */
 static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
+	spin_lock(&sbi->bitmap_lock);
+	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno)) {
+		spin_unlock(&sbi->bitmap_lock);
 		return;
-
+	}
 	sbi->nr_free_blocks++;
+	spin_unlock(&sbi->bitmap_lock);
 	pr_debug("%s:%d: freed block %u\n",
 		 __func__, __LINE__, bno);
 }
@@ -0,0 +1,377 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/falloc.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Cold tier layout: the tier is cut in slots of OUICHEFS_MAX_FILESIZE bytes,
+ * block i of a demoted file being stored at block i of its slot. Slots are
+ * allocated from the start of the tier, so its size only depends on the
+ * number of demoted files: the slot of a file is recorded in its inode, and
+ * the used slots are found again at mount by reading the inode store.
+ */
+static inline loff_t ouichefs_cold_offset(uint32_t slot, int block)
+{
+	return (loff_t)slot * OUICHEFS_MAX_FILESIZE +
+		(loff_t)block * OUICHEFS_BLOCK_SIZE;
+}
+
+static int cold_slot_get(struct ouichefs_sb_info *sbi, uint32_t *slot)
+{
+	unsigned long s;
+
+	spin_lock(&sbi->bitmap_lock);
+	s = find_first_zero_bit(sbi->cold_slots, sbi->nr_inodes);
+	if (s < sbi->nr_inodes)
+		set_bit(s, sbi->cold_slots);
+	spin_unlock(&sbi->bitmap_lock);
+	if (s >= sbi->nr_inodes)
+		return -ENOSPC;
+
+	*slot = s;
+	return 0;
+}
+
+/*
+ * Give back the space of slot to the cold tier.
+ */
+static void cold_slot_put(struct ouichefs_sb_info *sbi, uint32_t slot)
+{
+	vfs_fallocate(sbi->cold, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      ouichefs_cold_offset(slot, 0), OUICHEFS_MAX_FILESIZE);
+	spin_lock(&sbi->bitmap_lock);
+	clear_bit(slot, sbi->cold_slots);
+	spin_unlock(&sbi->bitmap_lock);
+}
+
+/*
+ * Mark the slots of the cold inodes of sb as used, reading the inode store.
+ */
+static int cold_scan(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode *cinode;
+	struct buffer_head *bh;
+	uint32_t i, j, slot;
+
+	for (i = 0; i < sbi->nr_istore_blocks; i++) {
+		bh = sb_bread(sb, i + 1);
+		if (!bh)
+			return -EIO;
+		cinode = (struct ouichefs_inode *)bh->b_data;
+		for (j = 0; j < OUICHEFS_INODES_PER_BLOCK; j++, cinode++) {
+			if (!(le32_to_cpu(cinode->i_flags) & OUICHEFS_FL_COLD))
+				continue;
+			slot = le32_to_cpu(cinode->i_cold_slot);
+			if (slot < sbi->nr_inodes)
+				set_bit(slot, sbi->cold_slots);
+		}
+		brelse(bh);
+	}
+
+	return 0;
+}
+
+/*
+ * Open the cold tier at path for sb. Without path, eviction unlinks files.
+ */
+int ouichefs_cold_init(struct super_block *sb, const char *path)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct file *cold;
+	umode_t mode;
+	int ret;
+
+	if (!path)
+		return 0;
+
+	cold = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(cold)) {
+		pr_err("cannot open cold tier '%s'\n", path);
+		return PTR_ERR(cold);
+	}
+	mode = file_inode(cold)->i_mode;
+	if (!S_ISREG(mode) && !S_ISBLK(mode)) {
+		pr_err("cold tier '%s' is not a file nor a block device\n",
+		       path);
+		fput(cold);
+		return -EINVAL;
+	}
+
+	sbi->cold_slots = kvcalloc(BITS_TO_LONGS(sbi->nr_inodes),
+				   sizeof(long), GFP_KERNEL);
+	if (!sbi->cold_slots) {
+		fput(cold);
+		return -ENOMEM;
+	}
+	sbi->cold = cold;
+	ret = cold_scan(sb);
+	if (ret) {
+		ouichefs_cold_destroy(sb);
+		return ret;
+	}
+	pr_info("cold tier '%s' attached\n", path);
+
+	return 0;
+}
+
+void ouichefs_cold_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (sbi && sbi->cold) {
+		fput(sbi->cold);
+		sbi->cold = NULL;
+		kvfree(sbi->cold_slots);
+		sbi->cold_slots = NULL;
+	}
+}
+
+/*
+ * Drop the block bno from the buffer cache of the device, once written.
+ */
+static void cold_forget_block(struct super_block *sb, uint32_t bno)
+{
+	pgoff_t index = bno >> (PAGE_SHIFT - sb->s_blocksize_bits);
+
+	clean_bdev_aliases(sb->s_bdev, bno, 1);
+	invalidate_mapping_pages(sb->s_bdev->bd_inode->i_mapping, index,
+				 index);
+}
+
+/*
+ * Move the data of inode, contained in dir, to the cold tier and free its
+ * data blocks. The inode and its index block stay, flagged as cold, until
+ * the file is opened again. The data is read through the page cache of the
+ * file, and synced to the cold tier before any block is freed, so a failure
+ * loses nothing. The caller holds dir locked and a reference on inode.
+ * Returns -EBUSY if inode was opened or demoted since it was chosen, or if
+ * some of its new blocks are not written back yet.
+ */
+int ouichefs_cold_demote(struct inode *dir, struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	struct page *page;
+	uint32_t nr_blocks_old, slot;
+	loff_t pos;
+	int i, ret = 0;
+
+	if (!sbi->cold)
+		return -ENODEV;
+
+	/* Keep open, recall and truncate away while the data moves */
+	inode_lock_nested(inode, I_MUTEX_CHILD);
+	if ((ci->flags & OUICHEFS_FL_COLD) || ouichefs_fblocks_busy(inode, 1)) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+	/* The data is copied from the disk: it must all be written back */
+	if (ouichefs_file_commit(inode, false)) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+	nr_blocks_old = inode->i_blocks;
+
+	ret = cold_slot_get(sbi, &slot);
+	if (ret)
+		goto unlock;
+	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto put_slot;
+	}
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	/* Copy data blocks to the cold tier */
+	for (i = 0; i < nr_blocks_old - 1; i++) {
+		if (!index->blocks[i])
+			continue;
+		/*
+		 * Through the page cache of the file: the buffer cache of the
+		 * device may hold an old copy of the block
+		 */
+		page = read_mapping_page(inode->i_mapping, i, NULL);
+		if (IS_ERR(page)) {
+			ret = PTR_ERR(page);
+			goto release;
+		}
+		pos = ouichefs_cold_offset(slot, i);
+		if (kernel_write(sbi->cold, kmap(page), OUICHEFS_BLOCK_SIZE,
+				 &pos) != OUICHEFS_BLOCK_SIZE)
+			ret = -EIO;
+		kunmap(page);
+		put_page(page);
+		if (ret)
+			goto release;
+	}
+	if (i > 0)
+		ret = vfs_fsync_range(sbi->cold, ouichefs_cold_offset(slot, 0),
+				      ouichefs_cold_offset(slot, i) - 1, 1);
+	if (ret)
+		goto release;
+
+	/* Free data blocks, keep the index block for the recall */
+	truncate_inode_pages(inode->i_mapping, 0);
+	for (i = 0; i < nr_blocks_old - 1; i++) {
+		if (!index->blocks[i])
+			continue;
+		put_block(sbi, index->blocks[i]);
+		index->blocks[i] = 0;
+	}
+	mark_buffer_dirty(bh_index);
+
+	spin_lock(&inode->i_lock);
+	ci->flags |= OUICHEFS_FL_COLD;
+	ci->cold_slot = slot;
+	spin_unlock(&inode->i_lock);
+	inode->i_blocks = 1;
+	mark_inode_dirty(inode);
+	ouichefs_summary_update(dir, NULL, 1 - (int)nr_blocks_old, 0);
+
+release:
+	brelse(bh_index);
+put_slot:
+	if (ret)
+		cold_slot_put(sbi, slot);
+unlock:
+	inode_unlock(inode);
+	return ret;
+}
+
+/*
+ * Bring back the data of a cold inode, contained in dir, from the cold tier.
+ * Each block is written before it enters the index, and dropped from the
+ * buffer cache of the device. On failure, the blocks allocated so far are
+ * freed and the file stays cold.
+ */
+int ouichefs_cold_recall(struct inode *dir, struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index, *bh;
+	uint32_t nr_blocks_old, bno;
+	loff_t pos;
+	ssize_t len;
+	int i, nr, ret = 0;
+
+	inode_lock(inode);
+	if (!(ci->flags & OUICHEFS_FL_COLD))
+		goto unlock;
+	if (!sbi->cold) {
+		pr_err("inode %lu is on the cold tier, mount with cold=\n",
+		       inode->i_ino);
+		ret = -EIO;
+		goto unlock;
+	}
+
+	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto unlock;
+	}
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	/* The data blocks of a cold file are all freed by the demotion */
+	nr = DIV_ROUND_UP(inode->i_size, OUICHEFS_BLOCK_SIZE);
+	for (i = 0; i < nr; i++) {
+		bno = get_free_block(sbi);
+		if (!bno) {
+			ret = -ENOSPC;
+			break;
+		}
+
+		bh = sb_getblk(sb, bno);
+		if (!bh) {
+			put_block(sbi, bno);
+			ret = -ENOMEM;
+			break;
+		}
+		lock_buffer(bh);
+		pos = ouichefs_cold_offset(ci->cold_slot, i);
+		len = kernel_read(sbi->cold, bh->b_data, OUICHEFS_BLOCK_SIZE,
+				  &pos);
+		if (len >= 0) {
+			/* Holes and end of the cold file read as zeroes */
+			memset(bh->b_data + len, 0, OUICHEFS_BLOCK_SIZE - len);
+			set_buffer_uptodate(bh);
+		}
+		unlock_buffer(bh);
+		if (len >= 0) {
+			/* Freed blocks are not scrubbed: data before index */
+			mark_buffer_dirty(bh);
+			ret = sync_dirty_buffer(bh);
+		} else {
+			ret = len;
+		}
+		brelse(bh);
+		/*
+		 * The file reads and writes this block through its page cache
+		 * from now on: do not leave a copy in the device's
+		 */
+		cold_forget_block(sb, bno);
+		if (ret) {
+			put_block(sbi, bno);
+			break;
+		}
+		index->blocks[i] = bno;
+	}
+
+	/* Failed: free the blocks allocated, dropping what was read in them */
+	for (i = 0; ret && i < nr; i++) {
+		bno = index->blocks[i];
+		if (!bno)
+			continue;
+		put_block(sbi, bno);
+		index->blocks[i] = 0;
+	}
+	mark_buffer_dirty(bh_index);
+	brelse(bh_index);
+
+	if (!ret) {
+		spin_lock(&inode->i_lock);
+		ci->flags &= ~OUICHEFS_FL_COLD;
+		spin_unlock(&inode->i_lock);
+		nr_blocks_old = inode->i_blocks;
+		inode->i_blocks = nr + 1;
+		mark_inode_dirty(inode);
+		ouichefs_summary_update(dir, inode,
+					(int)(inode->i_blocks - nr_blocks_old),
+					0);
+		ouichefs_cold_release(inode);
+	}
+unlock:
+	inode_unlock(inode);
+	return ret;
+}
+
+/*
+ * Give back the cold tier slot of inode, when it is recalled or unlinked.
+ */
+void ouichefs_cold_release(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+
+	if (!sbi->cold)
+		return;
+	cold_slot_put(sbi, OUICHEFS_INODE(inode)->cold_slot);
+}
@@ -10,62 +10,411 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
 
 #include "ouichefs.h"
+#include "ioctl_ouichefs.h"
+
+struct ouichefs_readdir {
+	struct dir_context *ctx;
+	struct inode *dir;
+	loff_t pos;		/* Position in the entries, after . and .. */
+};
+
+static int ouichefs_readdir_actor(void *data, const char *name,
+				  unsigned int len, uint32_t ino,
+				  unsigned int type)
+{
+	struct ouichefs_readdir *rd = data;
+
+	rd->ctx->pos = rd->pos + 2;
+	return !dir_emit(rd->ctx, name, len, ino, type);
+}
 
 /*
  * Iterate over the files contained in dir and commit them in ctx.
  * This function is called by the VFS while ctx->pos changes.
+ * After . and .., ctx->pos is the position of the next file, see
+ * ouichefs_dir_read().
  * Return 0 on success.
  */
 static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(dir);
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct super_block *sb = inode->i_sb;
-	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
-	int i;
+	struct ouichefs_readdir rd = { .ctx = ctx, .dir = inode };
+	int ret;
 
 	/* Check that dir is a directory */
 	if (!S_ISDIR(inode->i_mode))
 		return -ENOTDIR;
 
-	/*
-	 * Check that ctx->pos is not bigger than what we can handle (including
-	 * . and ..)
-	 */
-	if (ctx->pos > OUICHEFS_MAX_SUBFILES + 2)
-		return 0;
-
 	/* Commit . and .. to ctx */
 	if (!dir_emit_dots(dir, ctx))
 		return 0;
 
-	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Iterate over the index block and commit subfiles */
-	for (i = ctx->pos - 2; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
-			break;
-		if (!dir_emit(ctx, f->filename, OUICHEFS_FILENAME_LEN,
-			      f->inode, DT_UNKNOWN))
-			break;
-		ctx->pos++;
+	/* Commit subfiles until ctx is full */
+	rd.pos = ctx->pos - 2;
+	ret = ouichefs_dir_read(inode, &rd.pos, ouichefs_readdir_actor, &rd);
+	ctx->pos = rd.pos + 2;
+
+	return ret < 0 ? ret : 0;
+}
+
+struct ouichefs_readdir_plus_buf {
+	struct ouichefs_dirent_plus *entries;
+	uint32_t *inos;
+	uint32_t nr;
+	uint32_t max;
+};
+
+static int ouichefs_readdir_plus_actor(void *data, const char *name,
+				       unsigned int len, uint32_t ino,
+				       unsigned int type)
+{
+	struct ouichefs_readdir_plus_buf *buf = data;
+	struct ouichefs_dirent_plus *e;
+
+	if (buf->nr == buf->max)
+		return 1;
+	e = &buf->entries[buf->nr];
+	e->ino = ino;
+	e->name_len = len;
+	memcpy(e->name, name, len);
+	e->name[len] = '\0';
+	buf->inos[buf->nr++] = ino;
+	return 0;
+}
+
+/*
+ * Fill the attributes of e from its inode if it is in memory, from the inode
+ * store otherwise.
+ */
+static void ouichefs_readdir_plus_attr(struct super_block *sb,
+				       struct ouichefs_dirent_plus *e)
+{
+	struct ouichefs_inode *cinode;
+	struct buffer_head *bh;
+	struct inode *inode;
+
+	inode = ilookup(sb, e->ino);
+	if (inode) {
+		e->mode = inode->i_mode;
+		e->uid = i_uid_read(inode);
+		e->gid = i_gid_read(inode);
+		e->nlink = inode->i_nlink;
+		e->size = inode->i_size;
+		e->blocks = inode->i_blocks;
+		e->atime = inode->i_atime.tv_sec;
+		e->mtime = inode->i_mtime.tv_sec;
+		e->ctime = inode->i_ctime.tv_sec;
+		iput(inode);
+		return;
 	}
 
+	bh = sb_bread(sb, e->ino / OUICHEFS_INODES_PER_BLOCK + 1);
+	if (!bh)
+		return;
+	cinode = (struct ouichefs_inode *)bh->b_data;
+	cinode += e->ino % OUICHEFS_INODES_PER_BLOCK;
+	e->mode = le32_to_cpu(cinode->i_mode);
+	e->uid = le32_to_cpu(cinode->i_uid);
+	e->gid = le32_to_cpu(cinode->i_gid);
+	e->nlink = le32_to_cpu(cinode->i_nlink);
+	e->size = le32_to_cpu(cinode->i_size);
+	e->blocks = le32_to_cpu(cinode->i_blocks);
+	e->atime = le32_to_cpu(cinode->i_atime);
+	e->mtime = le32_to_cpu(cinode->i_mtime);
+	e->ctime = le32_to_cpu(cinode->i_ctime);
 	brelse(bh);
+}
 
-	return 0;
+/*
+ * Read up to req->nr entries of dir from req->cookie, with the attributes of
+ * their files. The inode store blocks of all the entries are read ahead at
+ * once, in increasing order, and the inodes are not loaded in the inode
+ * cache.
+ */
+static int ouichefs_readdir_plus(struct inode *dir,
+				 struct ouichefs_readdir_plus *req)
+{
+	struct ouichefs_readdir_plus_buf buf = { 0 };
+	loff_t pos = req->cookie;
+	uint32_t i;
+	int ret;
+
+	buf.max = min_t(uint32_t, req->nr, OUICHEFS_READDIR_PLUS_MAX);
+	buf.entries = kvcalloc(buf.max, sizeof(*buf.entries), GFP_KERNEL);
+	buf.inos = kvmalloc_array(buf.max, sizeof(*buf.inos), GFP_KERNEL);
+	if (!buf.entries || !buf.inos) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	inode_lock_shared(dir);
+	ret = ouichefs_dir_read(dir, &pos, ouichefs_readdir_plus_actor,
+				&buf);
+	inode_unlock_shared(dir);
+	if (ret < 0)
+		goto out;
+	req->eof = !ret;
+	req->cookie = pos;
+	req->nr = buf.nr;
+
+	ouichefs_readahead_inodes(dir->i_sb, buf.inos, buf.nr);
+	for (i = 0; i < buf.nr; i++)
+		ouichefs_readdir_plus_attr(dir->i_sb, &buf.entries[i]);
+
+	ret = 0;
+	if (copy_to_user(u64_to_user_ptr(req->entries), buf.entries,
+			 buf.nr * sizeof(*buf.entries)))
+		ret = -EFAULT;
+out:
+	kvfree(buf.inos);
+	kvfree(buf.entries);
+	return ret;
+}
+
+/* Apply op in the directory parent, which is locked */
+static int ouichefs_batch_op(struct dentry *parent,
+			     struct ouichefs_batch_op *op)
+{
+	struct inode *dir = d_inode(parent);
+	struct dentry *dentry;
+	int ret;
+
+	if (op->name_len > OUICHEFS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+	dentry = lookup_one_len(op->name, parent, op->name_len);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+
+	switch (op->op) {
+	case OUICHEFS_BATCH_CREATE:
+		if (d_really_is_positive(dentry))
+			ret = -EEXIST;
+		else
+			ret = vfs_create(dir, dentry,
+					 (op->mode & S_IALLUGO &
+					  ~current_umask()) | S_IFREG, true);
+		break;
+	case OUICHEFS_BATCH_UNLINK:
+		if (d_really_is_negative(dentry))
+			ret = -ENOENT;
+		else if (d_is_dir(dentry))
+			ret = -EISDIR;
+		else
+			ret = vfs_unlink(dir, dentry, NULL);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	dput(dentry);
+
+	return ret;
+}
+
+/*
+ * Apply the operations of req in dir, going through the VFS so that the
+ * dentry cache, permissions and notifications stay right, but taking the
+ * directory lock and write access to the mount only once.
+ */
+static int ouichefs_batch(struct file *dir, struct ouichefs_batch *req)
+{
+	struct dentry *parent = dir->f_path.dentry;
+	struct inode *inode = d_inode(parent);
+	struct ouichefs_batch_op *ops;
+	size_t size;
+	uint32_t i;
+	int ret;
+
+	if (req->nr > OUICHEFS_BATCH_MAX)
+		return -E2BIG;
+	size = req->nr * sizeof(*ops);
+	ops = kvmalloc(size, GFP_KERNEL);
+	if (!ops)
+		return -ENOMEM;
+	if (copy_from_user(ops, u64_to_user_ptr(req->ops), size)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	ret = mnt_want_write_file(dir);
+	if (ret)
+		goto out;
+	inode_lock_nested(inode, I_MUTEX_PARENT);
+	for (i = 0; i < req->nr; i++)
+		ops[i].result = ouichefs_batch_op(parent, &ops[i]);
+	inode_unlock(inode);
+	mnt_drop_write_file(dir);
+
+	if (copy_to_user(u64_to_user_ptr(req->ops), ops, size))
+		ret = -EFAULT;
+out:
+	kvfree(ops);
+	return ret;
+}
+
+/*
+ * Remove the subdirectory req->name of dir with all its subtree. The files of
+ * the subtree are removed without checking the permissions of the
+ * directories containing them, so this is reserved to CAP_SYS_ADMIN.
+ */
+static int ouichefs_rmtree_ioctl(struct file *dir,
+				 struct ouichefs_rmtree *req)
+{
+	struct dentry *parent = dir->f_path.dentry;
+	struct inode *inode = d_inode(parent);
+	struct dentry *dentry;
+	struct path path;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (req->name_len > OUICHEFS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+	ret = mnt_want_write_file(dir);
+	if (ret)
+		return ret;
+	inode_lock_nested(inode, I_MUTEX_PARENT);
+
+	dentry = lookup_one_len(req->name, parent, req->name_len);
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto unlock;
+	}
+	path.mnt = dir->f_path.mnt;
+	path.dentry = dentry;
+
+	if (d_really_is_negative(dentry))
+		ret = -ENOENT;
+	else if (!d_is_dir(dentry))
+		ret = -ENOTDIR;
+	else if (d_mountpoint(dentry) || path_has_submounts(&path))
+		ret = -EBUSY;
+	else
+		ret = inode_permission(inode, MAY_WRITE | MAY_EXEC);
+	if (!ret)
+		ret = ouichefs_rmtree(inode, dentry);
+	dput(dentry);
+
+unlock:
+	inode_unlock(inode);
+	mnt_drop_write_file(dir);
+	return ret;
+}
+
+/*
+ * ioctl on a directory.
+ */
+static long ouichefs_dir_ioctl(struct file *dir, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct inode *inode = file_inode(dir);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_candidate *candidates;
+	struct ouichefs_dry_run dry_run;
+	struct ouichefs_readdir_plus readdir_plus;
+	struct ouichefs_batch batch;
+	struct ouichefs_rmtree rmtree;
+	struct dentry *parent;
+	uint32_t budget, ttl;
+	int ret;
+
+	if (_IOC_TYPE(cmd) != IOC_MAGIC)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case SET_BUDGET:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (get_user(budget, (uint32_t __user *)arg))
+			return -EFAULT;
+		inode_lock(inode);
+		ci->budget = budget;
+		mark_inode_dirty(inode);
+		/* Bring the subtree back under its new budget right away */
+		ret = ouichefs_budget_enforce(inode, 0, inode);
+		inode_unlock(inode);
+		return ret;
+	case GET_BUDGET:
+		return put_user(ci->budget, (uint32_t __user *)arg);
+	case SET_TTL:
+		if (!inode_owner_or_capable(inode))
+			return -EPERM;
+		if (get_user(ttl, (uint32_t __user *)arg))
+			return -EFAULT;
+		parent = dget_parent(dir->f_path.dentry);
+		ouichefs_ttl_set(d_inode(parent), inode, ttl);
+		dput(parent);
+		return 0;
+	case GET_TTL:
+		return put_user(ci->ttl, (uint32_t __user *)arg);
+	case DRY_RUN:
+		/* Names and inodes of the whole subtree, whatever its modes */
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&dry_run, (void __user *)arg,
+				   sizeof(dry_run)))
+			return -EFAULT;
+		dry_run.nr = min_t(uint32_t, dry_run.nr, OUICHEFS_DRY_RUN_MAX);
+		candidates = kmalloc_array(dry_run.nr, sizeof(*candidates),
+					   GFP_KERNEL);
+		if (!candidates)
+			return -ENOMEM;
+		ret = ouichefs_fblocks_dry_run(inode, candidates, dry_run.nr);
+		if (ret >= 0) {
+			dry_run.nr = ret;
+			ret = 0;
+			if (copy_to_user(u64_to_user_ptr(dry_run.candidates),
+					 candidates,
+					 dry_run.nr * sizeof(*candidates)) ||
+			    copy_to_user((void __user *)arg, &dry_run,
+					 sizeof(dry_run)))
+				ret = -EFAULT;
+		}
+		kfree(candidates);
+		return ret;
+	case READDIR_PLUS:
+		if (copy_from_user(&readdir_plus, (void __user *)arg,
+				   sizeof(readdir_plus)))
+			return -EFAULT;
+		ret = ouichefs_readdir_plus(inode, &readdir_plus);
+		if (!ret && copy_to_user((void __user *)arg, &readdir_plus,
+					 sizeof(readdir_plus)))
+			ret = -EFAULT;
+		return ret;
+	case BATCH:
+		if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+			return -EFAULT;
+		return ouichefs_batch(dir, &batch);
+	case RMTREE:
+		if (copy_from_user(&rmtree, (void __user *)arg, sizeof(rmtree)))
+			return -EFAULT;
+		return ouichefs_rmtree_ioctl(dir, &rmtree);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Readdir positions go past the maximum size of a file, up to
+ * OUICHEFS_DIR_POS_END after . and ..: seekdir() must reach all of them.
+ */
+static loff_t ouichefs_dir_llseek(struct file *file, loff_t offset,
+				  int whence)
+{
+	loff_t max = OUICHEFS_DIR_POS_END + 2;
+
+	return generic_file_llseek_size(file, offset, whence, max, max);
 }
 
 const struct file_operations ouichefs_dir_ops = {
 	.owner = THIS_MODULE,
+	.llseek = ouichefs_dir_llseek,
 	.iterate_shared = ouichefs_iterate,
+	.unlocked_ioctl = ouichefs_dir_ioctl,
 };
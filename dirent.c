@@ -0,0 +1,897 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/bitrev.h>
+#include <linux/sort.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * On-disk format of the directories.
+ *
+ * A directory starts with a single block of entries, its index block. When
+ * this block is full, the directory is converted to a hashed directory: a
+ * new index block (struct ouichefs_dir_htree) lists the leaf blocks holding
+ * the entries, the first one being the former index block. Names are hashed,
+ * and the low bits of the hash select a bucket pointing to the leaf holding
+ * the name. When a leaf is full, it is split in two on the next bit of the
+ * hash, doubling the number of buckets if needed (extendible hashing).
+ * Finding a name thus reads the index block and a single leaf.
+ *
+ * In each leaf, the entries are packed at the start of the block. Each one
+ * has the length of its name and the type of its file, so that readdir does
+ * not need to read the inodes. Removing a file only clears the inode of its
+ * entry, leaving a tombstone that a new entry of the same size or smaller
+ * can take, so that live entries only move when a full leaf is compacted or
+ * split. Readdir positions thus do not depend on where entries are: they
+ * come from the hash of their names (see ouichefs_dir_read()), and stay
+ * valid whatever moves between two calls.
+ *
+ * Changes are done with the i_rwsem of the directory held exclusive, also
+ * when the module removes files on its own (eviction, TTL, RMTREE).
+ */
+
+#define OUICHEFS_DIR_MAX_DEPTH	ilog2(OUICHEFS_DIR_BUCKETS)
+
+/*
+ * Hash of a name. It is stored on disk through the bucket of each name, so
+ * it must not depend on the architecture (FNV-1a).
+ */
+u32 ouichefs_dir_hash(const char *name, unsigned int len)
+{
+	u32 hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Get the entry at offset off of a directory block, or NULL past its last
+ * entry. A corrupted entry ends the block.
+ */
+struct ouichefs_dirent *ouichefs_dirent_get(void *block, unsigned int off)
+{
+	struct ouichefs_dirent *de = block + off;
+
+	if (off + sizeof(*de) > OUICHEFS_BLOCK_SIZE || !de->rec_len)
+		return NULL;
+	if (de->rec_len < OUICHEFS_DIRENT_LEN(de->name_len) ||
+	    off + de->rec_len > OUICHEFS_BLOCK_SIZE) {
+		pr_err("corrupted directory entry at offset %u\n", off);
+		return NULL;
+	}
+	return de;
+}
+
+static bool dir_name_eq(const struct ouichefs_dirent *de, const char *name,
+			unsigned int len)
+{
+	return de->name_len == len && !memcmp(de->name, name, len);
+}
+
+/* Number of entries of a leaf, tombstones excluded */
+static int dir_leaf_count(void *block)
+{
+	struct ouichefs_dirent *de;
+	unsigned int off;
+	int nr = 0;
+
+	for_each_dirent(de, block, off)
+		if (de->inode)
+			nr++;
+	return nr;
+}
+
+/*
+ * Get the block number of the leaf at position pos of a directory, given its
+ * index block and flags. Returns 0 past the last leaf.
+ */
+uint32_t ouichefs_dir_leaf_at(struct super_block *sb, uint32_t index_block,
+			      uint32_t flags, unsigned int pos)
+{
+	struct ouichefs_dir_htree *htree;
+	struct buffer_head *bh;
+	uint32_t bno = 0;
+
+	if (!(flags & OUICHEFS_FL_HTREE))
+		return pos ? 0 : index_block;
+
+	bh = sb_bread(sb, index_block);
+	if (!bh)
+		return 0;
+	htree = (struct ouichefs_dir_htree *)bh->b_data;
+	if (pos < htree->nr_leaves)
+		bno = htree->leaves[pos];
+	brelse(bh);
+
+	return bno;
+}
+
+/*
+ * Get the number of leaves of dir.
+ */
+int ouichefs_dir_nr_leaves(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct buffer_head *bh;
+	int nr;
+
+	if (!(ci->flags & OUICHEFS_FL_HTREE))
+		return 1;
+
+	bh = sb_bread(dir->i_sb, ci->index_block);
+	if (!bh)
+		return -EIO;
+	nr = ((struct ouichefs_dir_htree *)bh->b_data)->nr_leaves;
+	brelse(bh);
+
+	return nr;
+}
+
+/*
+ * Find the leaf of dir that holds the names with this hash: its position in
+ * the leaves and its block number.
+ */
+int ouichefs_dir_leaf(struct inode *dir, u32 hash, unsigned int *pos,
+		      uint32_t *bno)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_htree *htree;
+	struct buffer_head *bh;
+
+	if (!(ci->flags & OUICHEFS_FL_HTREE)) {
+		*pos = 0;
+		*bno = ci->index_block;
+		return 0;
+	}
+
+	bh = sb_bread(dir->i_sb, ci->index_block);
+	if (!bh)
+		return -EIO;
+	htree = (struct ouichefs_dir_htree *)bh->b_data;
+	*pos = htree->buckets[hash & ((1U << htree->depth) - 1)];
+	*bno = htree->leaves[*pos];
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * Call actor on each entry of the leaf bno, until it returns non-zero.
+ * Returns the last value returned by actor.
+ */
+int ouichefs_dir_leaf_walk(struct super_block *sb, uint32_t bno,
+			   ouichefs_dir_actor_t actor, void *data)
+{
+	struct ouichefs_dirent *de;
+	struct buffer_head *bh;
+	unsigned int off;
+	int ret = 0;
+
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+
+	for_each_dirent(de, bh->b_data, off) {
+		if (!de->inode)
+			continue;
+		ret = actor(data, de->name, de->name_len, de->inode,
+			    de->file_type);
+		if (ret)
+			break;
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Call actor on each entry of the directory with this index block and
+ * flags, until it returns non-zero. Returns the last value returned by
+ * actor.
+ */
+int ouichefs_dir_walk(struct super_block *sb, uint32_t index_block,
+		      uint32_t flags, ouichefs_dir_actor_t actor, void *data)
+{
+	uint32_t bno;
+	unsigned int pos;
+	int ret = 0;
+
+	for (pos = 0; !ret; pos++) {
+		bno = ouichefs_dir_leaf_at(sb, index_block, flags, pos);
+		if (!bno)
+			break;
+		ret = ouichefs_dir_leaf_walk(sb, bno, actor, data);
+	}
+
+	return ret;
+}
+
+/*
+ * Readdir position of the names with this hash: the hash with its bits
+ * reversed, on 31 bits. The names of a leaf share the low bits of their
+ * hash, so their positions are the ones between two bounds.
+ */
+static u32 dir_hash_pos(u32 hash)
+{
+	return bitrev32(hash) >> 1;
+}
+
+/*
+ * Find the leaf of dir holding the readdir position pos: its block number,
+ * and the first position of this leaf and of the next one.
+ */
+static int dir_leaf_span(struct inode *dir, loff_t pos, uint32_t *bno,
+			 loff_t *start, loff_t *end)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_htree *htree;
+	struct buffer_head *bh;
+	u32 hash = bitrev32((u32)pos << 1);
+	unsigned int b, nr_buckets, leaf, shared = 0, depth;
+
+	if (!(ci->flags & OUICHEFS_FL_HTREE)) {
+		*bno = ci->index_block;
+		*start = 0;
+		*end = OUICHEFS_DIR_POS_END;
+		return 0;
+	}
+
+	bh = sb_bread(dir->i_sb, ci->index_block);
+	if (!bh)
+		return -EIO;
+	htree = (struct ouichefs_dir_htree *)bh->b_data;
+	nr_buckets = 1U << htree->depth;
+	leaf = htree->buckets[hash & (nr_buckets - 1)];
+	*bno = htree->leaves[leaf];
+	for (b = 0; b < nr_buckets; b++)
+		if (htree->buckets[b] == leaf)
+			shared++;
+	depth = htree->depth - ilog2(shared);
+	brelse(bh);
+
+	/* The positions of the leaf share their depth high bits */
+	*start = (pos >> (31 - depth)) << (31 - depth);
+	*end = *start + (1LL << (31 - depth));
+
+	return 0;
+}
+
+struct ouichefs_dir_pos {
+	u32 pos;
+	u16 off;
+};
+
+static int dir_pos_cmp(const void *a, const void *b)
+{
+	const struct ouichefs_dir_pos *x = a, *y = b;
+
+	if (x->pos != y->pos)
+		return x->pos < y->pos ? -1 : 1;
+	return x->off - y->off;
+}
+
+/*
+ * Call actor on each entry of dir from position *pos, until it returns
+ * non-zero. The position of an entry comes from the hash of its name, see
+ * dir_hash_pos(), so that it does not change when the entry moves to
+ * another leaf or inside its leaf: entries are read leaf by leaf, each one
+ * in the order of their positions. *pos is set to the position of each
+ * entry before actor is called on it, and to OUICHEFS_DIR_POS_END once all
+ * the entries are read. Two names with the same position may be read twice
+ * if actor stops on the second one. Returns the last value returned by
+ * actor.
+ */
+int ouichefs_dir_read(struct inode *dir, loff_t *pos,
+		      ouichefs_dir_actor_t actor, void *data)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_pos *ents;
+	struct ouichefs_dirent *de;
+	struct buffer_head *bh;
+	unsigned int off, nr, i;
+	uint32_t bno, *inos;
+	loff_t start, end;
+	u32 p;
+	int ret = 0;
+
+	ents = kmalloc_array(OUICHEFS_MAX_SUBFILES, sizeof(*ents), GFP_KERNEL);
+	inos = kmalloc_array(OUICHEFS_MAX_SUBFILES, sizeof(*inos), GFP_KERNEL);
+	if (!ents || !inos) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (!ret && *pos < OUICHEFS_DIR_POS_END) {
+		ret = dir_leaf_span(dir, *pos, &bno, &start, &end);
+		if (ret)
+			break;
+		bh = sb_bread(sb, bno);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+
+		nr = 0;
+		for_each_dirent(de, bh->b_data, off) {
+			if (!de->inode)
+				continue;
+			p = dir_hash_pos(ouichefs_dir_hash(de->name,
+							   de->name_len));
+			if (p < *pos)
+				continue;
+			ents[nr].pos = p;
+			ents[nr].off = off;
+			inos[nr++] = de->inode;
+		}
+		sort(ents, nr, sizeof(*ents), dir_pos_cmp, NULL);
+
+		/*
+		 * Entering the leaf from its start: its inodes will likely be
+		 * looked up next. This is not done again each time a reader
+		 * resumes in the middle of it.
+		 */
+		if (*pos == start)
+			ouichefs_readahead_inodes(sb, inos, nr);
+
+		for (i = 0; i < nr && !ret; i++) {
+			de = (struct ouichefs_dirent *)(bh->b_data +
+							ents[i].off);
+			*pos = ents[i].pos;
+			ret = actor(data, de->name, de->name_len, de->inode,
+				    de->file_type);
+		}
+		brelse(bh);
+		if (!ret)
+			*pos = end;
+	}
+out:
+	kfree(inos);
+	kfree(ents);
+	return ret;
+}
+
+struct ouichefs_dir_inos {
+	uint32_t *inos;
+	int nr;
+	int max;
+};
+
+static int dir_inos_actor(void *data, const char *name, unsigned int len,
+			  uint32_t ino, unsigned int type)
+{
+	struct ouichefs_dir_inos *d = data;
+
+	if (d->nr == d->max)
+		return 1;
+	d->inos[d->nr++] = ino;
+	return 0;
+}
+
+/*
+ * Get the inode numbers of the files of the directory with this index block
+ * and flags, in an array to free with kvfree(). Returns the number of files.
+ */
+int ouichefs_dir_inos(struct super_block *sb, uint32_t index_block,
+		      uint32_t flags, uint32_t **inos)
+{
+	struct ouichefs_dir_inos d = { .max = OUICHEFS_MAX_SUBFILES };
+	struct ouichefs_dir_htree *htree;
+	struct buffer_head *bh;
+	int ret;
+
+	if (flags & OUICHEFS_FL_HTREE) {
+		bh = sb_bread(sb, index_block);
+		if (!bh)
+			return -EIO;
+		htree = (struct ouichefs_dir_htree *)bh->b_data;
+		d.max = htree->nr_leaves * OUICHEFS_MAX_SUBFILES;
+		brelse(bh);
+	}
+
+	d.inos = kvmalloc_array(d.max, sizeof(uint32_t), GFP_KERNEL);
+	if (!d.inos)
+		return -ENOMEM;
+	ret = ouichefs_dir_walk(sb, index_block, flags, dir_inos_actor, &d);
+	if (ret < 0) {
+		kvfree(d.inos);
+		return ret;
+	}
+	*inos = d.inos;
+
+	return d.nr;
+}
+
+/*
+ * Get the number of files in dir.
+ */
+int ouichefs_dir_nr_files(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct buffer_head *bh;
+	int nr;
+
+	bh = sb_bread(dir->i_sb, ci->index_block);
+	if (!bh)
+		return -EIO;
+	if (ci->flags & OUICHEFS_FL_HTREE)
+		nr = ((struct ouichefs_dir_htree *)bh->b_data)->nr_files;
+	else
+		nr = dir_leaf_count(bh->b_data);
+	brelse(bh);
+
+	return nr;
+}
+
+/*
+ * Allocate a zeroed block for dir, without reading its old content.
+ */
+static uint32_t dir_new_block(struct inode *dir, struct buffer_head **bh)
+{
+	struct super_block *sb = dir->i_sb;
+	uint32_t bno;
+
+	bno = get_free_block(OUICHEFS_SB(sb));
+	if (!bno)
+		return 0;
+	*bh = sb_getblk(sb, bno);
+	if (!*bh) {
+		put_block(OUICHEFS_SB(sb), bno);
+		return 0;
+	}
+	lock_buffer(*bh);
+	memset((*bh)->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	set_buffer_uptodate(*bh);
+	unlock_buffer(*bh);
+	mark_buffer_dirty(*bh);
+
+	dir->i_blocks++;
+	dir->i_size += OUICHEFS_BLOCK_SIZE;
+	mark_inode_dirty(dir);
+
+	return bno;
+}
+
+/*
+ * Convert the single block directory dir to a hashed directory, whose only
+ * leaf is its former index block.
+ */
+static int dir_convert(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_htree *htree;
+	struct buffer_head *bh;
+	uint32_t bno;
+	int nr_files;
+
+	nr_files = ouichefs_dir_nr_files(dir);
+	if (nr_files < 0)
+		return nr_files;
+
+	bno = dir_new_block(dir, &bh);
+	if (!bno)
+		return -ENOSPC;
+	htree = (struct ouichefs_dir_htree *)bh->b_data;
+	htree->depth = 0;
+	htree->nr_leaves = 1;
+	htree->nr_files = nr_files;
+	htree->buckets[0] = 0;
+	htree->leaves[0] = ci->index_block;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	ci->index_block = bno;
+	ci->flags |= OUICHEFS_FL_HTREE;
+	mark_inode_dirty(dir);
+
+	return 0;
+}
+
+/*
+ * Split the full leaf at position pos of dir in two, on the first bit of the
+ * hash it does not discriminate yet.
+ */
+static int dir_split(struct inode *dir, unsigned int pos)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_htree *htree;
+	struct ouichefs_dirent *de;
+	struct buffer_head *bh, *bh_old, *bh_new;
+	unsigned int b, nr_buckets, shared = 0, depth, new_pos;
+	unsigned int off, n = 0, len, hole = OUICHEFS_BLOCK_SIZE;
+	uint32_t bno;
+	int ret = 0;
+
+	if (!(ci->flags & OUICHEFS_FL_HTREE)) {
+		ret = dir_convert(dir);
+		if (ret)
+			return ret;
+	}
+
+	bh = sb_bread(sb, ci->index_block);
+	if (!bh)
+		return -EIO;
+	htree = (struct ouichefs_dir_htree *)bh->b_data;
+
+	/* The leaf is shared by 1 << (depth - local depth) buckets */
+	nr_buckets = 1U << htree->depth;
+	for (b = 0; b < nr_buckets; b++)
+		if (htree->buckets[b] == pos)
+			shared++;
+	depth = htree->depth - ilog2(shared);
+
+	if (htree->nr_leaves == OUICHEFS_DIR_MAX_LEAVES) {
+		ret = -EMLINK;
+		goto out;
+	}
+	if (depth == htree->depth) {
+		if (htree->depth == OUICHEFS_DIR_MAX_DEPTH) {
+			ret = -EMLINK;
+			goto out;
+		}
+		memcpy(htree->buckets + nr_buckets, htree->buckets,
+		       nr_buckets * sizeof(uint32_t));
+		htree->depth++;
+		nr_buckets <<= 1;
+	}
+
+	bh_old = sb_bread(sb, htree->leaves[pos]);
+	if (!bh_old) {
+		ret = -EIO;
+		goto out;
+	}
+	bno = dir_new_block(dir, &bh_new);
+	if (!bno) {
+		brelse(bh_old);
+		ret = -ENOSPC;
+		goto out;
+	}
+	new_pos = htree->nr_leaves++;
+	htree->leaves[new_pos] = bno;
+	for (b = 0; b < nr_buckets; b++)
+		if (htree->buckets[b] == pos && (b >> depth) & 1)
+			htree->buckets[b] = new_pos;
+	ouichefs_dir_index_split(dir, pos, new_pos);
+
+	/*
+	 * Move the entries of the new buckets, leaving tombstones in the old
+	 * leaf so that the entries kept there do not move. Consecutive
+	 * tombstones are merged, and the ones at the end of the leaf dropped.
+	 */
+	for_each_dirent(de, bh_old->b_data, off) {
+		if (de->inode &&
+		    (ouichefs_dir_hash(de->name, de->name_len) >> depth) & 1) {
+			len = OUICHEFS_DIRENT_LEN(de->name_len);
+			memcpy(bh_new->b_data + n, de, len);
+			((struct ouichefs_dirent *)(bh_new->b_data + n))->rec_len =
+				len;
+			ouichefs_dir_index_move(dir, de->name, de->name_len, n);
+			n += len;
+			de->inode = 0;
+		}
+		if (de->inode)
+			hole = OUICHEFS_BLOCK_SIZE;
+		else if (hole == OUICHEFS_BLOCK_SIZE)
+			hole = off;
+		else
+			((struct ouichefs_dirent *)(bh_old->b_data + hole))->rec_len
+				+= de->rec_len;
+	}
+	if (hole < off)
+		memset(bh_old->b_data + hole, 0, off - hole);
+	mark_buffer_dirty(bh_old);
+	mark_buffer_dirty(bh_new);
+	brelse(bh_old);
+	brelse(bh_new);
+	mark_buffer_dirty(bh);
+out:
+	brelse(bh);
+	return ret;
+}
+
+/* Add delta to the file count of dir, for hashed directories */
+static void dir_count(struct inode *dir, int delta)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct buffer_head *bh;
+
+	if (!(ci->flags & OUICHEFS_FL_HTREE))
+		return;
+	bh = sb_bread(dir->i_sb, ci->index_block);
+	if (!bh)
+		return;
+	((struct ouichefs_dir_htree *)bh->b_data)->nr_files += delta;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+}
+
+/*
+ * Find room for an entry of len bytes in the leaf at position pos of dir:
+ * the tombstone of the last removal if it is large enough, another large
+ * enough tombstone, or the end of the leaf. Returns its offset, or -ENOSPC.
+ */
+static int dir_leaf_slot(struct inode *dir, void *block, unsigned int pos,
+			 unsigned int len)
+{
+	struct ouichefs_dirent *de;
+	unsigned int off;
+
+	off = ouichefs_dir_index_hint(dir, pos);
+	if (off < OUICHEFS_BLOCK_SIZE) {
+		de = ouichefs_dirent_get(block, off);
+		if (de && !de->inode && de->rec_len >= len)
+			return off;
+	}
+
+	for_each_dirent(de, block, off)
+		if (!de->inode && de->rec_len >= len)
+			return off;
+
+	if (off + len <= OUICHEFS_BLOCK_SIZE)
+		return off;
+	return -ENOSPC;
+}
+
+/*
+ * Compact the leaf bno, at position pos of dir, merging its tombstones in
+ * free room at its end, if this gives room for an entry of len bytes.
+ * Returns 0 if the leaf was compacted.
+ */
+static int dir_compact(struct inode *dir, unsigned int pos, uint32_t bno,
+		       unsigned int len)
+{
+	struct ouichefs_dirent *de;
+	struct buffer_head *bh;
+	unsigned int off, used = 0;
+	char *tmp;
+
+	bh = sb_bread(dir->i_sb, bno);
+	if (!bh)
+		return -EIO;
+	for_each_dirent(de, bh->b_data, off)
+		if (de->inode)
+			used += OUICHEFS_DIRENT_LEN(de->name_len);
+	if (used + len > OUICHEFS_BLOCK_SIZE) {
+		brelse(bh);
+		return -ENOSPC;
+	}
+
+	tmp = kzalloc(OUICHEFS_BLOCK_SIZE, GFP_NOFS);
+	if (!tmp) {
+		brelse(bh);
+		return -ENOMEM;
+	}
+	used = 0;
+	for_each_dirent(de, bh->b_data, off) {
+		if (!de->inode)
+			continue;
+		memcpy(tmp + used, de, OUICHEFS_DIRENT_LEN(de->name_len));
+		((struct ouichefs_dirent *)(tmp + used))->rec_len =
+			OUICHEFS_DIRENT_LEN(de->name_len);
+		ouichefs_dir_index_move(dir, de->name, de->name_len, used);
+		used += OUICHEFS_DIRENT_LEN(de->name_len);
+	}
+	memcpy(bh->b_data, tmp, OUICHEFS_BLOCK_SIZE);
+	kfree(tmp);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	/* No tombstone is left */
+	ouichefs_dir_index_set_hint(dir, pos, OUICHEFS_BLOCK_SIZE);
+
+	return 0;
+}
+
+/*
+ * Add the entry name -> ino, of DT_* type, to dir, growing dir if needed.
+ * Returns -EMLINK if dir cannot hold more files.
+ */
+int ouichefs_dir_add(struct inode *dir, const char *name, unsigned int len,
+		     uint32_t ino, unsigned int type)
+{
+	struct ouichefs_dirent *de;
+	struct buffer_head *bh;
+	u32 hash = ouichefs_dir_hash(name, len);
+	unsigned int pos, need = OUICHEFS_DIRENT_LEN(len), rest;
+	uint32_t bno;
+	int off, ret;
+
+	for (;;) {
+		ret = ouichefs_dir_leaf(dir, hash, &pos, &bno);
+		if (ret)
+			return ret;
+		bh = sb_bread(dir->i_sb, bno);
+		if (!bh)
+			return -EIO;
+		off = dir_leaf_slot(dir, bh->b_data, pos, need);
+		if (off >= 0)
+			break;
+		brelse(bh);
+
+		/* Full leaf: compact it if possible, split it otherwise */
+		if (!dir_compact(dir, pos, bno, need))
+			continue;
+		ret = dir_split(dir, pos);
+		if (ret)
+			return ret;
+	}
+
+	de = (struct ouichefs_dirent *)(bh->b_data + off);
+	if (!de->rec_len) {
+		/* At the end of the leaf */
+		de->rec_len = need;
+	} else if (de->rec_len - need >= OUICHEFS_DIRENT_LEN(1)) {
+		/* Keep the rest of a large tombstone as another tombstone */
+		rest = de->rec_len - need;
+		de->rec_len = need;
+		memset(bh->b_data + off + need, 0,
+		       sizeof(struct ouichefs_dirent));
+		((struct ouichefs_dirent *)(bh->b_data + off + need))->rec_len =
+			rest;
+		ouichefs_dir_index_set_hint(dir, pos, off + need);
+	}
+	de->inode = ino;
+	de->name_len = len;
+	de->file_type = type;
+	memcpy(de->name, name, len);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	dir_count(dir, 1);
+	ouichefs_dir_index_add(dir, name, len, ino, pos, off);
+
+	return 0;
+}
+
+/*
+ * Turn the entry at offset off of a leaf into a tombstone, merging the
+ * tombstone that follows it. If this leaves tombstones at the end of the
+ * leaf, they are all dropped. Returns the offset of the tombstone, or
+ * OUICHEFS_BLOCK_SIZE if it was dropped.
+ */
+static unsigned int dir_leaf_bury(void *block, unsigned int off)
+{
+	struct ouichefs_dirent *de = block + off, *next;
+	unsigned int end = off + de->rec_len, start, o;
+
+	de->inode = 0;
+	next = ouichefs_dirent_get(block, end);
+	if (next && !next->inode) {
+		de->rec_len += next->rec_len;
+		end += next->rec_len;
+		next = ouichefs_dirent_get(block, end);
+	}
+	if (next || (end + sizeof(*de) <= OUICHEFS_BLOCK_SIZE &&
+		     ((struct ouichefs_dirent *)(block + end))->rec_len))
+		return off;
+
+	/*
+	 * Keep the end of the leaf zeroed, new entries are added there: drop
+	 * the tombstones preceding this one too.
+	 */
+	start = OUICHEFS_BLOCK_SIZE;
+	for_each_dirent(de, block, o) {
+		if (o >= off)
+			break;
+		if (de->inode)
+			start = OUICHEFS_BLOCK_SIZE;
+		else if (start == OUICHEFS_BLOCK_SIZE)
+			start = o;
+	}
+	start = min(start, off);
+	memset(block + start, 0, end - start);
+
+	return OUICHEFS_BLOCK_SIZE;
+}
+
+/*
+ * Remove name, or ino if name is NULL, from the leaf bno at position pos.
+ * The entry becomes a tombstone, found through the index if it knows it.
+ */
+static int dir_del_leaf(struct inode *dir, unsigned int pos, uint32_t bno,
+			const char *name, unsigned int len, uint32_t ino)
+{
+	struct ouichefs_dirent *de;
+	struct buffer_head *bh;
+	unsigned int off;
+
+	bh = sb_bread(dir->i_sb, bno);
+	if (!bh)
+		return -EIO;
+
+	if (name && !ouichefs_dir_index_off(dir, name, len, &off)) {
+		de = ouichefs_dirent_get(bh->b_data, off);
+		if (de && de->inode && dir_name_eq(de, name, len))
+			goto found;
+	}
+
+	for_each_dirent(de, bh->b_data, off) {
+		if (!de->inode)
+			continue;
+		if (name ? dir_name_eq(de, name, len) : de->inode == ino)
+			goto found;
+	}
+	brelse(bh);
+
+	return -ENOENT;
+
+found:
+	ouichefs_dir_index_del(dir, de->name, de->name_len);
+	off = dir_leaf_bury(bh->b_data, off);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	ouichefs_dir_index_set_hint(dir, pos, off);
+	dir_count(dir, -1);
+
+	return 0;
+}
+
+/*
+ * Remove the entry name from dir. If name is NULL, remove the entry of ino,
+ * which requires reading all the leaves.
+ */
+int ouichefs_dir_del(struct inode *dir, const char *name, unsigned int len,
+		     uint32_t ino)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	unsigned int pos;
+	uint32_t bno;
+	int ret;
+
+	if (name) {
+		ret = ouichefs_dir_leaf(dir, ouichefs_dir_hash(name, len),
+					&pos, &bno);
+		if (ret)
+			return ret;
+		return dir_del_leaf(dir, pos, bno, name, len, ino);
+	}
+
+	for (pos = 0; ; pos++) {
+		bno = ouichefs_dir_leaf_at(dir->i_sb, ci->index_block,
+					   ci->flags, pos);
+		if (!bno)
+			return -ENOENT;
+		ret = dir_del_leaf(dir, pos, bno, NULL, 0, ino);
+		if (ret != -ENOENT)
+			return ret;
+	}
+}
+
+/*
+ * Free the blocks of a directory, given its index block and flags, except
+ * its index block.
+ */
+void ouichefs_dir_free_leaves(struct super_block *sb, uint32_t index_block,
+			      uint32_t flags)
+{
+	struct ouichefs_dir_htree *htree;
+	struct buffer_head *bh;
+	int i;
+
+	if (!(flags & OUICHEFS_FL_HTREE))
+		return;
+	bh = sb_bread(sb, index_block);
+	if (!bh)
+		return;
+	htree = (struct ouichefs_dir_htree *)bh->b_data;
+	for (i = 0; i < htree->nr_leaves && i < OUICHEFS_DIR_MAX_LEAVES; i++)
+		put_block(OUICHEFS_SB(sb), htree->leaves[i]);
+	brelse(bh);
+}
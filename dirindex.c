@@ -0,0 +1,449 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/sched/mm.h>
+#include <linux/buffer_head.h>
+
+#include "ouichefs.h"
+
+/*
+ * In-memory index of the names of a directory, so that lookups and existence
+ * checks do not read and scan the directory blocks. The leaves of the
+ * directory are loaded in the index the first time a name they hold is
+ * looked up, and the index is updated by every change of the directory
+ * afterwards. Once all the leaves are loaded, lookups never read a block.
+ * When an update cannot be done (out of memory), the index is dropped and
+ * built again on next use.
+ *
+ * The index also remembers where each name is in its leaf, so that removals
+ * find the entry to clear without scanning the leaf, and the last tombstone
+ * left in each leaf, where the next entry added to the leaf should go.
+ *
+ * Changes run with dir->i_rwsem held exclusive, including the removals done
+ * by the eviction, the TTL reaper and RMTREE, but lookups only hold it
+ * shared and may load leaves in parallel: the index is protected by a
+ * spinlock.
+ *
+ * The hash table has 64 buckets per leaf of the directory, up to
+ * 1 << OUICHEFS_DIR_HASH_MAX_BITS, and grows as leaves are split.
+ */
+
+#define OUICHEFS_DIR_HASH_BITS		6	/* Per leaf */
+#define OUICHEFS_DIR_HASH_MAX_BITS	14
+
+/* A name of the directory */
+struct ouichefs_dir_entry {
+	struct hlist_node node;
+	u32 hash;
+	uint32_t ino;
+	u16 off;	/* Offset of the entry in its leaf */
+	u16 len;
+	char name[];
+};
+
+struct ouichefs_dir_index {
+	spinlock_t lock;
+	struct hlist_head *names;
+	unsigned int bits;	/* names has 1 << bits buckets */
+	DECLARE_BITMAP(loaded, OUICHEFS_DIR_MAX_LEAVES); /* Leaves in names */
+	unsigned int nr_loaded;
+	unsigned int nr_leaves;
+	u16 hint[OUICHEFS_DIR_MAX_LEAVES]; /* Last tombstone of each leaf */
+};
+
+#define OUICHEFS_DIR_NO_HINT	0xffff
+
+/* Number of bits of the hash table for a directory of nr_leaves leaves */
+static unsigned int dir_index_bits(unsigned int nr_leaves)
+{
+	return min_t(unsigned int,
+		     order_base_2(nr_leaves) + OUICHEFS_DIR_HASH_BITS,
+		     OUICHEFS_DIR_HASH_MAX_BITS);
+}
+
+/* Allocate an empty hash table of 1 << bits buckets */
+static struct hlist_head *dir_index_table(unsigned int bits)
+{
+	struct hlist_head *names;
+	unsigned int i, nofs;
+
+	nofs = memalloc_nofs_save();
+	names = kvmalloc_array(1U << bits, sizeof(*names), GFP_KERNEL);
+	memalloc_nofs_restore(nofs);
+	if (!names)
+		return NULL;
+	for (i = 0; i < (1U << bits); i++)
+		INIT_HLIST_HEAD(&names[i]);
+
+	return names;
+}
+
+static struct hlist_head *dir_index_bucket(struct ouichefs_dir_index *idx,
+					   u32 hash)
+{
+	return &idx->names[hash_32(hash, idx->bits)];
+}
+
+static struct ouichefs_dir_entry *dir_index_find(struct ouichefs_dir_index *idx,
+						 const char *name,
+						 unsigned int len, u32 hash)
+{
+	struct ouichefs_dir_entry *e;
+
+	hlist_for_each_entry(e, dir_index_bucket(idx, hash), node)
+		if (e->hash == hash && e->len == len &&
+		    !memcmp(e->name, name, len))
+			return e;
+	return NULL;
+}
+
+static struct ouichefs_dir_entry *dir_entry_alloc(const char *name,
+						  unsigned int len,
+						  uint32_t ino,
+						  unsigned int off)
+{
+	struct ouichefs_dir_entry *e;
+
+	e = kmalloc(sizeof(*e) + len, GFP_NOFS);
+	if (!e)
+		return NULL;
+	e->hash = ouichefs_dir_hash(name, len);
+	e->ino = ino;
+	e->off = off;
+	e->len = len;
+	memcpy(e->name, name, len);
+
+	return e;
+}
+
+static void dir_index_free(struct ouichefs_dir_index *idx)
+{
+	struct ouichefs_dir_entry *e;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; i < (1U << idx->bits); i++)
+		hlist_for_each_entry_safe(e, tmp, &idx->names[i], node)
+			kfree(e);
+	kvfree(idx->names);
+	kfree(idx);
+}
+
+/*
+ * Move the names of idx to a larger hash table if it has more leaves than
+ * its table was sized for. The old table is kept if the new one cannot be
+ * allocated: lookups are only slower.
+ */
+static void dir_index_grow(struct ouichefs_dir_index *idx)
+{
+	unsigned int bits = dir_index_bits(idx->nr_leaves), old_bits, i;
+	struct hlist_head *names, *old;
+	struct ouichefs_dir_entry *e;
+	struct hlist_node *tmp;
+
+	if (bits <= idx->bits)
+		return;
+	names = dir_index_table(bits);
+	if (!names)
+		return;
+
+	spin_lock(&idx->lock);
+	old = idx->names;
+	old_bits = idx->bits;
+	idx->names = names;
+	idx->bits = bits;
+	for (i = 0; i < (1U << old_bits); i++)
+		hlist_for_each_entry_safe(e, tmp, &old[i], node)
+			hlist_add_head(&e->node,
+				       dir_index_bucket(idx, e->hash));
+	spin_unlock(&idx->lock);
+	kvfree(old);
+}
+
+/*
+ * Get the index of dir, creating it if needed.
+ */
+static struct ouichefs_dir_index *dir_index_get(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_index *idx, *old;
+	int nr_leaves;
+
+	idx = READ_ONCE(ci->dir_index);
+	if (idx)
+		return idx;
+
+	nr_leaves = ouichefs_dir_nr_leaves(dir);
+	if (nr_leaves < 0)
+		return ERR_PTR(nr_leaves);
+	idx = kzalloc(sizeof(*idx), GFP_NOFS);
+	if (!idx)
+		return ERR_PTR(-ENOMEM);
+	idx->bits = dir_index_bits(nr_leaves);
+	idx->names = dir_index_table(idx->bits);
+	if (!idx->names) {
+		kfree(idx);
+		return ERR_PTR(-ENOMEM);
+	}
+	spin_lock_init(&idx->lock);
+	idx->nr_leaves = nr_leaves;
+	memset(idx->hint, 0xff, sizeof(idx->hint));
+
+	/* Parallel lookups may create it at the same time */
+	old = cmpxchg(&ci->dir_index, NULL, idx);
+	if (old) {
+		dir_index_free(idx);
+		return old;
+	}
+	return idx;
+}
+
+/*
+ * Drop the index of dir, it will be built again on next use.
+ */
+void ouichefs_dir_index_drop(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_index *idx = xchg(&ci->dir_index, NULL);
+
+	if (idx)
+		dir_index_free(idx);
+}
+
+/*
+ * Load the names of the leaf bno, at position pos in dir, in idx.
+ */
+static int dir_index_load(struct inode *dir, struct ouichefs_dir_index *idx,
+			  unsigned int pos, uint32_t bno)
+{
+	struct ouichefs_dirent *de;
+	struct ouichefs_dir_entry *e;
+	struct buffer_head *bh;
+	struct hlist_node *tmp;
+	unsigned int off;
+	HLIST_HEAD(list);
+	int ret = 0;
+
+	bh = sb_bread(dir->i_sb, bno);
+	if (!bh)
+		return -EIO;
+	for_each_dirent(de, bh->b_data, off) {
+		if (!de->inode)
+			continue;
+		e = dir_entry_alloc(de->name, de->name_len, de->inode, off);
+		if (!e) {
+			ret = -ENOMEM;
+			break;
+		}
+		hlist_add_head(&e->node, &list);
+	}
+	brelse(bh);
+
+	spin_lock(&idx->lock);
+	if (!ret && !test_and_set_bit(pos, idx->loaded)) {
+		idx->nr_loaded++;
+		hlist_for_each_entry_safe(e, tmp, &list, node) {
+			hlist_del(&e->node);
+			hlist_add_head(&e->node,
+				       dir_index_bucket(idx, e->hash));
+		}
+	}
+	spin_unlock(&idx->lock);
+
+	/* Leftovers: error, or loaded by a parallel lookup */
+	hlist_for_each_entry_safe(e, tmp, &list, node)
+		kfree(e);
+
+	return ret;
+}
+
+/*
+ * Find name in dir. Returns 0 and fill ino if found, -ENOENT if not found.
+ */
+int ouichefs_dir_find(struct inode *dir, const char *name, unsigned int len,
+		      uint32_t *ino)
+{
+	struct ouichefs_dir_index *idx = dir_index_get(dir);
+	struct ouichefs_dir_entry *e;
+	u32 hash = ouichefs_dir_hash(name, len);
+	unsigned int pos;
+	uint32_t bno;
+	bool loaded;
+	int ret;
+
+	if (IS_ERR(idx))
+		return PTR_ERR(idx);
+
+	spin_lock(&idx->lock);
+	e = dir_index_find(idx, name, len, hash);
+	loaded = idx->nr_loaded == idx->nr_leaves;
+	if (e && ino)
+		*ino = e->ino;
+	spin_unlock(&idx->lock);
+	if (e)
+		return 0;
+	if (loaded)
+		return -ENOENT;
+
+	/* Load the leaf that would hold name and look again */
+	ret = ouichefs_dir_leaf(dir, hash, &pos, &bno);
+	if (ret)
+		return ret;
+	if (!test_bit(pos, idx->loaded)) {
+		ret = dir_index_load(dir, idx, pos, bno);
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&idx->lock);
+	e = dir_index_find(idx, name, len, hash);
+	if (e && ino)
+		*ino = e->ino;
+	spin_unlock(&idx->lock);
+
+	return e ? 0 : -ENOENT;
+}
+
+/*
+ * Find the offset of name in its leaf, if the index knows it. The caller
+ * must check the entry there, the index may be out of date.
+ */
+int ouichefs_dir_index_off(struct inode *dir, const char *name,
+			   unsigned int len, unsigned int *off)
+{
+	struct ouichefs_dir_index *idx = OUICHEFS_INODE(dir)->dir_index;
+	struct ouichefs_dir_entry *e;
+
+	if (!idx)
+		return -ENOENT;
+	spin_lock(&idx->lock);
+	e = dir_index_find(idx, name, len, ouichefs_dir_hash(name, len));
+	if (e)
+		*off = e->off;
+	spin_unlock(&idx->lock);
+
+	return e ? 0 : -ENOENT;
+}
+
+/*
+ * Get the offset of the last tombstone left in the leaf at position pos of
+ * dir, or a value past the end of the leaf if there is none known.
+ */
+unsigned int ouichefs_dir_index_hint(struct inode *dir, unsigned int pos)
+{
+	struct ouichefs_dir_index *idx = OUICHEFS_INODE(dir)->dir_index;
+
+	if (!idx || pos >= OUICHEFS_DIR_MAX_LEAVES)
+		return OUICHEFS_DIR_NO_HINT;
+	return READ_ONCE(idx->hint[pos]);
+}
+
+/*
+ * Report a tombstone at offset off of the leaf at position pos of dir.
+ */
+void ouichefs_dir_index_set_hint(struct inode *dir, unsigned int pos,
+				 unsigned int off)
+{
+	struct ouichefs_dir_index *idx = OUICHEFS_INODE(dir)->dir_index;
+
+	if (idx && pos < OUICHEFS_DIR_MAX_LEAVES)
+		WRITE_ONCE(idx->hint[pos], off);
+}
+
+/*
+ * Report the addition of name at offset off of the leaf at position pos of
+ * dir.
+ */
+void ouichefs_dir_index_add(struct inode *dir, const char *name,
+			    unsigned int len, uint32_t ino, unsigned int pos,
+			    unsigned int off)
+{
+	struct ouichefs_dir_index *idx = OUICHEFS_INODE(dir)->dir_index;
+	struct ouichefs_dir_entry *e;
+
+	if (!idx || !test_bit(pos, idx->loaded))
+		return;
+	e = dir_entry_alloc(name, len, ino, off);
+	if (!e) {
+		ouichefs_dir_index_drop(dir);
+		return;
+	}
+	spin_lock(&idx->lock);
+	hlist_add_head(&e->node, dir_index_bucket(idx, e->hash));
+	spin_unlock(&idx->lock);
+}
+
+/*
+ * Report that name was moved to offset off of its leaf, or of the leaf the
+ * split of its leaf gave it to.
+ */
+void ouichefs_dir_index_move(struct inode *dir, const char *name,
+			     unsigned int len, unsigned int off)
+{
+	struct ouichefs_dir_index *idx = OUICHEFS_INODE(dir)->dir_index;
+	struct ouichefs_dir_entry *e;
+
+	if (!idx)
+		return;
+	spin_lock(&idx->lock);
+	e = dir_index_find(idx, name, len, ouichefs_dir_hash(name, len));
+	if (e)
+		e->off = off;
+	spin_unlock(&idx->lock);
+}
+
+/*
+ * Report the split of the leaf at position pos of dir, giving the new leaf at
+ * position new_pos. The names moving to the new leaf stay in the index, so
+ * it is loaded if the old one is. The tombstones of the old leaf are merged
+ * by the split, forget them. The hash table grows with the leaves.
+ */
+void ouichefs_dir_index_split(struct inode *dir, unsigned int pos,
+			      unsigned int new_pos)
+{
+	struct ouichefs_dir_index *idx = OUICHEFS_INODE(dir)->dir_index;
+
+	if (!idx)
+		return;
+	spin_lock(&idx->lock);
+	idx->nr_leaves++;
+	if (test_bit(pos, idx->loaded)) {
+		set_bit(new_pos, idx->loaded);
+		idx->nr_loaded++;
+	}
+	WRITE_ONCE(idx->hint[pos], OUICHEFS_DIR_NO_HINT);
+	WRITE_ONCE(idx->hint[new_pos], OUICHEFS_DIR_NO_HINT);
+	spin_unlock(&idx->lock);
+
+	dir_index_grow(idx);
+}
+
+/*
+ * Report the removal of name from dir.
+ */
+void ouichefs_dir_index_del(struct inode *dir, const char *name,
+			    unsigned int len)
+{
+	struct ouichefs_dir_index *idx = OUICHEFS_INODE(dir)->dir_index;
+	struct ouichefs_dir_entry *e;
+
+	if (!idx)
+		return;
+	spin_lock(&idx->lock);
+	e = dir_index_find(idx, name, len, ouichefs_dir_hash(name, len));
+	if (e)
+		hlist_del(&e->node);
+	spin_unlock(&idx->lock);
+	kfree(e);
+}
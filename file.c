@@ -12,32 +12,290 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/mpage.h>
+#include <linux/log2.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
+#include "ioctl_ouichefs.h"
+
+/*
+ * Age the access counters of ci: they are halved for each
+ * OUICHEFS_HEAT_HALFLIFE elapsed since the last decay. Must be called with
+ * the inode's i_lock held.
+ */
+static void ouichefs_heat_decay(struct ouichefs_inode_info *ci, uint32_t now)
+{
+	uint32_t periods;
+
+	if (now <= ci->heat_stamp)
+		return;
+	periods = (now - ci->heat_stamp) / OUICHEFS_HEAT_HALFLIFE;
+	if (!periods)
+		return;
+
+	if (periods >= 32) {
+		ci->heat_read = 0;
+		ci->heat_write = 0;
+	} else {
+		ci->heat_read >>= periods;
+		ci->heat_write >>= periods;
+	}
+	ci->heat_stamp += periods * OUICHEFS_HEAT_HALFLIFE;
+}
+
+/*
+ * Count one read (or write if write is true) access to inode. To keep this
+ * cheap, the inode is only marked dirty when a counter reaches a power of 2,
+ * so the on-disk value is at most a factor 2 away from the in-memory one.
+ * With lazytime, reads only dirty the inode like an atime update does: it
+ * is written back with its next change, on eviction or by the periodic
+ * flush of timestamps.
+ */
+void ouichefs_heat_account(struct inode *inode, int write)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t *counter, heat;
+
+	spin_lock(&inode->i_lock);
+	ouichefs_heat_decay(ci, ktime_get_real_seconds());
+	counter = write ? &ci->heat_write : &ci->heat_read;
+	if (*counter < U32_MAX)
+		(*counter)++;
+	heat = *counter;
+	spin_unlock(&inode->i_lock);
+
+	if (!is_power_of_2(heat))
+		return;
+	if (!write && (inode->i_sb->s_flags & SB_LAZYTIME))
+		__mark_inode_dirty(inode, I_DIRTY_TIME);
+	else
+		mark_inode_dirty(inode);
+}
+
+/*
+ * Return the decayed access count (reads and writes) of inode. Used by
+ * eviction strategies to tell cold files from hot ones.
+ */
+uint32_t ouichefs_heat(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t heat;
+
+	spin_lock(&inode->i_lock);
+	ouichefs_heat_decay(ci, ktime_get_real_seconds());
+	heat = ci->heat_read + ci->heat_write;
+	if (heat < ci->heat_read)
+		heat = U32_MAX;
+	spin_unlock(&inode->i_lock);
+
+	return heat;
+}
+EXPORT_SYMBOL_GPL(ouichefs_heat);
+
+/*
+ * Get the index block of the file inode, to release with brelse(). While the
+ * file is open, it stays pinned once read, so that mapping a block is a
+ * memory lookup; the last close drops the pin, so that cached inodes of
+ * closed files do not each hold a block. Every change of the index block
+ * goes through the buffer cache, so it is seen through this buffer.
+ */
+static struct buffer_head *ouichefs_file_index(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+
+	spin_lock(&inode->i_lock);
+	bh = ci->index_bh;
+	if (bh)
+		get_bh(bh);
+	spin_unlock(&inode->i_lock);
+	if (bh)
+		return bh;
+
+	bh = sb_bread(inode->i_sb, ci->index_block);
+	if (!bh)
+		return NULL;
+
+	/* Parallel readers may read it at the same time */
+	spin_lock(&inode->i_lock);
+	if (!ci->index_bh && atomic_read(&ci->nr_open)) {
+		get_bh(bh);
+		ci->index_bh = bh;
+	}
+	spin_unlock(&inode->i_lock);
+
+	return bh;
+}
+
+/* Drop the pin of the index block of inode, if any */
+static void ouichefs_file_unpin(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+
+	spin_lock(&inode->i_lock);
+	bh = ci->index_bh;
+	ci->index_bh = NULL;
+	spin_unlock(&inode->i_lock);
+	brelse(bh);
+}
+
+/*
+ * Get the list of the blocks of inode allocated by buffered writes whose data
+ * is not on disk yet. It is allocated on first use, and freed when the inode
+ * is evicted.
+ */
+static uint32_t *ouichefs_file_pending(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t *pending, *old;
+
+	pending = READ_ONCE(ci->pending);
+	if (pending)
+		return pending;
+	pending = kcalloc(OUICHEFS_BLOCK_SIZE >> 2, sizeof(*pending), GFP_NOFS);
+	if (!pending)
+		return NULL;
+
+	old = cmpxchg(&ci->pending, NULL, pending);
+	if (old) {
+		kfree(pending);
+		return old;
+	}
+	return pending;
+}
+
+/*
+ * Get the physical block of the iblock-th block of the file, 0 if it is not
+ * allocated. Pending blocks are looked up first: they are written in the
+ * index before leaving the pending list.
+ */
+static uint32_t ouichefs_file_bno(struct ouichefs_inode_info *ci,
+				  struct ouichefs_file_index_block *index,
+				  sector_t iblock)
+{
+	uint32_t *pending = READ_ONCE(ci->pending);
+	uint32_t bno = 0;
+
+	if (pending)
+		bno = READ_ONCE(pending[iblock]);
+	if (!bno) {
+		smp_rmb();
+		bno = READ_ONCE(index->blocks[iblock]);
+	}
+	return bno;
+}
+
+/*
+ * Move the pending blocks of inode whose data reached the disk to its index
+ * block. Freed blocks are not scrubbed, so a block allocated by a buffered
+ * write only enters the index once its page is written back: after a crash,
+ * the index never points to the old content of a block. Pending blocks past
+ * the end of the file (their page was truncated) are freed. If all is true,
+ * the pages are not checked: the inode is leaving memory, its pages are
+ * written back or dropped. Return true if some blocks are still pending.
+ */
+bool ouichefs_file_commit(struct inode *inode, bool all)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_file_index_block *index;
+	uint32_t *pending = READ_ONCE(ci->pending);
+	struct buffer_head *bh_index;
+	struct page *page;
+	bool busy, left = false, dirty = false;
+	sector_t end;
+	uint32_t bno;
+	int i;
+
+	if (!pending)
+		return false;
+	bh_index = ouichefs_file_index(inode);
+	if (!bh_index)
+		return true;
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+
+	/* Writeback, truncate and eviction may commit at the same time */
+	spin_lock(&inode->i_lock);
+	end = DIV_ROUND_UP(i_size_read(inode), OUICHEFS_BLOCK_SIZE);
+	for (i = 0; i < OUICHEFS_BLOCK_SIZE >> 2; i++) {
+		bno = pending[i];
+		if (!bno)
+			continue;
+		if (!all) {
+			page = find_get_page(inode->i_mapping, i);
+			busy = page && (PageLocked(page) || PageDirty(page) ||
+					PageWriteback(page));
+			if (page)
+				put_page(page);
+			if (busy) {
+				left = true;
+				continue;
+			}
+		}
+		if (i >= end) {
+			put_block(sbi, bno);
+		} else {
+			WRITE_ONCE(index->blocks[i], bno);
+			dirty = true;
+		}
+		smp_wmb();
+		WRITE_ONCE(pending[i], 0);
+	}
+	spin_unlock(&inode->i_lock);
+
+	if (dirty)
+		mark_buffer_dirty(bh_index);
+	brelse(bh_index);
+	return left;
+}
+
+/*
+ * Commit the pending blocks of inode and unpin its index block, when it
+ * leaves memory.
+ */
+void ouichefs_file_index_put(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	ouichefs_file_commit(inode, true);
+	kfree(xchg(&ci->pending, NULL));
+	ouichefs_file_unpin(inode);
+}
 
 /*
  * Map the buffer_head passed in argument with the iblock-th block of the file
  * represented by inode. If the requested block is not allocated and create is
- * true,  allocate a new block on disk and map it.
+ * true,  allocate a new block on disk and map it. If the caller asks for more
+ * than one block, the following blocks are mapped too as long as they are
+ * contiguous on disk, so that readahead maps its window in one call.
+ *
+ * A block allocated for the page cache is pending until its page is written
+ * back (see ouichefs_file_commit()). Nothing orders the index after the data
+ * of direct I/O, so a block allocated for it is zeroed on disk first.
  */
-static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
-				   struct buffer_head *bh_result, int create)
+static int ouichefs_file_map(struct inode *inode, sector_t iblock,
+			     struct buffer_head *bh_result, int create,
+			     bool direct)
 {
 	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
 	struct buffer_head *bh_index;
+	uint32_t *pending = NULL;
 	bool alloc = false;
-	int ret = 0, bno;
+	uint32_t bno;
+	unsigned int nr = 1, max;
+	int ret;
 
 	/* If block number exceeds filesize, fail */
 	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
 		return -EFBIG;
 
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
+	bh_index = ouichefs_file_index(inode);
 	if (!bh_index)
 		return -EIO;
 	index = (struct ouichefs_file_index_block *)bh_index->b_data;
@@ -46,29 +304,70 @@ static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 	 * Check if iblock is already allocated. If not and create is true,
 	 * allocate it. Else, get the physical block number.
 	 */
-	if (index->blocks[iblock] == 0) {
+	bno = ouichefs_file_bno(ci, index, iblock);
+	if (!bno) {
+		ret = 0;
 		if (!create)
-			return 0;
+			goto out;
+		if (!direct) {
+			ret = -ENOMEM;
+			pending = ouichefs_file_pending(inode);
+			if (!pending)
+				goto out;
+		}
+		ret = -ENOSPC;
 		bno = get_free_block(sbi);
-		if (!bno) {
-			ret = -ENOSPC;
-			goto brelse_index;
+		if (!bno)
+			goto out;
+		if (direct) {
+			ret = sb_issue_zeroout(sb, bno, 1, GFP_NOFS);
+			if (ret) {
+				put_block(sbi, bno);
+				goto out;
+			}
+			index->blocks[iblock] = bno;
+			mark_buffer_dirty(bh_index);
+		} else {
+			WRITE_ONCE(pending[iblock], bno);
 		}
-		index->blocks[iblock] = bno;
 		alloc = true;
 	} else {
-		bno = index->blocks[iblock];
+		max = min_t(sector_t, bh_result->b_size >> inode->i_blkbits,
+			    (OUICHEFS_BLOCK_SIZE >> 2) - iblock);
+		while (nr < max &&
+		       ouichefs_file_bno(ci, index, iblock + nr) == bno + nr)
+			nr++;
 	}
 
 	/* Map the physical block to to the given buffer_head */
 	map_bh(bh_result, sb, bno);
+	bh_result->b_size = nr << inode->i_blkbits;
 
-brelse_index:
+	/*
+	 * Freed blocks are not scrubbed: a new block must never be read from
+	 * disk. The page cache zeroes the parts of it that are not written.
+	 */
+	if (alloc)
+		set_buffer_new(bh_result);
+	ret = 0;
+out:
 	brelse(bh_index);
-
 	return ret;
 }
 
+static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
+				   struct buffer_head *bh_result, int create)
+{
+	return ouichefs_file_map(inode, iblock, bh_result, create, false);
+}
+
+static int ouichefs_file_get_block_direct(struct inode *inode, sector_t iblock,
+					  struct buffer_head *bh_result,
+					  int create)
+{
+	return ouichefs_file_map(inode, iblock, bh_result, create, true);
+}
+
 /*
  * Called by the page cache to read a page from the physical disk and map it in
  * memory.
@@ -78,6 +377,17 @@ static int ouichefs_readpage(struct file *file, struct page *page)
 	return mpage_readpage(page, ouichefs_file_get_block);
 }
 
+/*
+ * Called by the page cache to read ahead pages. The blocks of the window are
+ * mapped at once when they are contiguous on disk, and read in large bios.
+ */
+static int ouichefs_readpages(struct file *file, struct address_space *mapping,
+			      struct list_head *pages, unsigned int nr_pages)
+{
+	return mpage_readpages(mapping, pages, nr_pages,
+			       ouichefs_file_get_block);
+}
+
 /*
  * Called by the page cache to write a dirty page to the physical disk (when
  * sync is called or when memory is needed).
@@ -87,6 +397,81 @@ static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
 	return block_write_full_page(page, ouichefs_file_get_block, wbc);
 }
 
+/*
+ * Called by the page cache to write the dirty pages of a file (fsync and
+ * background writeback). Dirty pages contiguous on disk are gathered in
+ * large bios, the others go through ouichefs_writepage().
+ */
+static int ouichefs_writepages(struct address_space *mapping,
+			       struct writeback_control *wbc)
+{
+	int ret;
+
+	ret = mpage_writepages(mapping, wbc, ouichefs_file_get_block);
+
+	/* Pages still in flight are committed by ouichefs_write_inode() */
+	if (ouichefs_file_commit(mapping->host, false))
+		mark_inode_dirty(mapping->host);
+	return ret;
+}
+
+/*
+ * Number of blocks a write of len bytes at pos in inode has to allocate.
+ */
+static uint32_t ouichefs_write_allocs(struct inode *inode, loff_t pos,
+				      loff_t len)
+{
+	uint32_t nr_allocs;
+
+	nr_allocs = max(pos + len, inode->i_size) / OUICHEFS_BLOCK_SIZE;
+	if (nr_allocs > inode->i_blocks - 1)
+		return nr_allocs - (inode->i_blocks - 1);
+	return 0;
+}
+
+/*
+ * Check if a write of len bytes at pos in file will be able to complete.
+ */
+static int ouichefs_write_prepare(struct file *file, loff_t pos, loff_t len)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
+
+	/* Check if the write can be completed (enough space?) */
+	if (pos + len > OUICHEFS_MAX_FILESIZE)
+		return -ENOSPC;
+	if (ouichefs_write_allocs(file->f_inode, pos, len) >
+	    sbi->nr_free_blocks)
+		return -ENOSPC;
+
+	return 0;
+}
+
+/*
+ * Make room in the parent directories that a write of len bytes at pos in
+ * file would take over their budget, and above the free blocks watermark.
+ * Eviction removes files and locks their parent, so this runs before the VFS
+ * takes the inode and page locks.
+ */
+static int ouichefs_write_budget(struct file *file, loff_t pos, loff_t len)
+{
+	struct dentry *parent;
+	uint32_t nr_allocs;
+	int err;
+
+	nr_allocs = ouichefs_write_allocs(file_inode(file), pos, len);
+	if (!nr_allocs)
+		return 0;
+
+	parent = dget_parent(file->f_path.dentry);
+	err = ouichefs_budget_enforce(d_inode(parent), nr_allocs, NULL);
+	dput(parent);
+	if (!err)
+		ouichefs_fblocks_watermark(file_inode(file)->i_sb, nr_allocs,
+					   NULL);
+
+	return err;
+}
+
 /*
  * Called by the VFS when a write() syscall occurs on file before writing the
  * data in the page cache. This functions checks if the write will be able to
@@ -97,22 +482,11 @@ static int ouichefs_write_begin(struct file *file,
 				unsigned int len, unsigned int flags,
 				struct page **pagep, void **fsdata)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
 	int err;
-	uint32_t nr_allocs = 0;
-	/* Check if the write can be completed (enough space?) */
-	if (pos + len > OUICHEFS_MAX_FILESIZE)
-	return -ENOSPC;
-	nr_allocs = max(pos + len, file->f_inode->i_size) / OUICHEFS_BLOCK_SIZE;
-	if (nr_allocs > file->f_inode->i_blocks - 1)
-		nr_allocs -= file->f_inode->i_blocks - 1;
-	else
-		nr_allocs = 0;
 
-	
-
-	if (nr_allocs > sbi->nr_free_blocks)
-	return -ENOSPC;
+	err = ouichefs_write_prepare(file, pos, len);
+	if (err)
+		return err;
 
 	/* prepare the write */
 	err = block_write_begin(mapping, pos, len, flags, pagep,
@@ -138,7 +512,6 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 {
 	int ret;
 	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
 
 	/* Complete the write() */
@@ -148,23 +521,31 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 		       __func__, __LINE__);
 	} else {
 		uint32_t nr_blocks_old = inode->i_blocks;
+		struct dentry *parent;
 
 		/* Update inode metadata */
 		inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
 		inode->i_mtime = inode->i_ctime = current_time(inode);
 		mark_inode_dirty(inode);
 
+		/* Report new size and blocks to the parent directories */
+		parent = dget_parent(file->f_path.dentry);
+		ouichefs_summary_update(d_inode(parent), inode,
+					(int)(inode->i_blocks - nr_blocks_old), 0);
+		dput(parent);
+
 		/* If file is smaller than before, free unused blocks */
 		if (nr_blocks_old > inode->i_blocks) {
 			int i;
 			struct buffer_head *bh_index;
 			struct ouichefs_file_index_block *index;
 
-			/* Free unused blocks from page cache */
+			/* Free unused blocks from page cache and pending list */
 			truncate_pagecache(inode, inode->i_size);
+			ouichefs_file_commit(inode, false);
 
-			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
+			/* Remove unused blocks from the index block */
+			bh_index = ouichefs_file_index(inode);
 			if (!bh_index) {
 				pr_err("failed truncating '%s'. we just lost %lu blocks\n",
 				       file->f_path.dentry->d_name.name,
@@ -176,6 +557,9 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 
 			for (i = inode->i_blocks - 1; i < nr_blocks_old - 1;
 			     i++) {
+				/* Holes, and pending blocks freed above */
+				if (!index->blocks[i])
+					continue;
 				put_block(OUICHEFS_SB(sb), index->blocks[i]);
 				index->blocks[i] = 0;
 			}
@@ -187,16 +571,205 @@ end:
 	return ret;
 }
 
+/*
+ * Called by the VFS on reads and writes of files opened with O_DIRECT. The
+ * data goes straight between the user buffer and the blocks mapped (and
+ * allocated for writes) by ouichefs_file_get_block_direct(), bypassing the
+ * page cache. Writes extending the file are done synchronously by the VFS,
+ * others may complete asynchronously (aio, io_uring).
+ */
+static ssize_t ouichefs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file->f_mapping->host;
+	uint32_t nr_blocks_old = inode->i_blocks;
+	struct dentry *parent;
+	loff_t end;
+	ssize_t ret;
+	int err;
+
+	if (iov_iter_rw(iter) == WRITE) {
+		err = ouichefs_write_prepare(file, iocb->ki_pos,
+					     iov_iter_count(iter));
+		if (err)
+			return err;
+	}
+
+	ret = blockdev_direct_IO(iocb, inode, iter,
+				 ouichefs_file_get_block_direct);
+	if (iov_iter_rw(iter) != WRITE || ret <= 0)
+		return ret;
+
+	/*
+	 * The VFS updates the size once we return, count the blocks of the
+	 * new size right away
+	 */
+	end = max_t(loff_t, iocb->ki_pos + ret, i_size_read(inode));
+	inode->i_blocks = end / OUICHEFS_BLOCK_SIZE + 2;
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+
+	/* Report new blocks to the parent directories */
+	if (inode->i_blocks != nr_blocks_old) {
+		parent = dget_parent(file->f_path.dentry);
+		ouichefs_summary_update(d_inode(parent), inode,
+					(int)(inode->i_blocks - nr_blocks_old),
+					0);
+		dput(parent);
+	}
+
+	return ret;
+}
+
 const struct address_space_operations ouichefs_aops = {
 	.readpage    = ouichefs_readpage,
+	.readpages   = ouichefs_readpages,
 	.writepage   = ouichefs_writepage,
+	.writepages  = ouichefs_writepages,
 	.write_begin = ouichefs_write_begin,
-	.write_end   = ouichefs_write_end
+	.write_end   = ouichefs_write_end,
+	.direct_IO   = ouichefs_direct_IO
 };
 
+/*
+ * Called by the VFS when a file is opened. Open files are never evicted.
+ */
+static int ouichefs_file_open(struct inode *inode, struct file *file)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct dentry *parent;
+	int ret;
+
+	atomic_inc(&ci->nr_open);
+	ret = generic_file_open(inode, file);
+
+	/* Bring back the data if the file was moved to the cold tier */
+	if (!ret && (ci->flags & OUICHEFS_FL_COLD)) {
+		parent = dget_parent(file->f_path.dentry);
+		ret = ouichefs_cold_recall(d_inode(parent), inode);
+		dput(parent);
+	}
+	if (ret)
+		atomic_dec(&ci->nr_open);
+
+	return ret;
+}
+
+/*
+ * Called by the VFS when the last reference to an open file is dropped.
+ */
+static int ouichefs_file_release(struct inode *inode, struct file *file)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	ci->close_stamp = ktime_get_real_seconds();
+	if (atomic_dec_and_test(&ci->nr_open))
+		ouichefs_file_unpin(inode);
+	return 0;
+}
+
+/*
+ * Called by the VFS on a read() syscall. Counts the access before reading
+ * through the page cache.
+ */
+static ssize_t ouichefs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ouichefs_heat_account(file_inode(iocb->ki_filp), 0);
+	return generic_file_read_iter(iocb, to);
+}
+
+/*
+ * Called by the VFS on a write() syscall. Counts the access and enforces the
+ * budgets of the parent directories before writing through the page cache.
+ */
+static ssize_t ouichefs_file_write_iter(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	loff_t pos = iocb->ki_pos;
+	int err;
+
+	ouichefs_heat_account(file_inode(file), 1);
+
+	if (iocb->ki_flags & IOCB_APPEND)
+		pos = i_size_read(file_inode(file));
+	err = ouichefs_write_budget(file, pos, iov_iter_count(from));
+	if (err)
+		return err;
+
+	return generic_file_write_iter(iocb, from);
+}
+
+/*
+ * ioctl on a regular file.
+ */
+static long ouichefs_file_ioctl(struct file *file, unsigned int cmd,
+				unsigned long arg)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_heat heat;
+	struct dentry *parent;
+	uint32_t ttl, pin;
+
+	if (_IOC_TYPE(cmd) != IOC_MAGIC)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case GET_HEAT:
+		spin_lock(&inode->i_lock);
+		ouichefs_heat_decay(ci, ktime_get_real_seconds());
+		heat.read = ci->heat_read;
+		heat.write = ci->heat_write;
+		heat.stamp = ci->heat_stamp;
+		spin_unlock(&inode->i_lock);
+		if (copy_to_user((void __user *)arg, &heat, sizeof(heat)))
+			return -EFAULT;
+		return 0;
+	case SET_TTL:
+		if (!inode_owner_or_capable(inode))
+			return -EPERM;
+		if (get_user(ttl, (uint32_t __user *)arg))
+			return -EFAULT;
+		parent = dget_parent(file->f_path.dentry);
+		ouichefs_ttl_set(d_inode(parent), inode, ttl);
+		dput(parent);
+		return 0;
+	case GET_TTL:
+		return put_user(ci->ttl, (uint32_t __user *)arg);
+	case SET_PIN:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (get_user(pin, (uint32_t __user *)arg))
+			return -EFAULT;
+		spin_lock(&inode->i_lock);
+		if (pin)
+			ci->flags |= OUICHEFS_FL_PINNED;
+		else
+			ci->flags &= ~OUICHEFS_FL_PINNED;
+		spin_unlock(&inode->i_lock);
+		mark_inode_dirty(inode);
+		/* The reaper dropped it while pinned */
+		if (!pin) {
+			parent = dget_parent(file->f_path.dentry);
+			ouichefs_ttl_queue(d_inode(parent), inode);
+			dput(parent);
+		}
+		return 0;
+	case GET_PIN:
+		return put_user(!!(ci->flags & OUICHEFS_FL_PINNED),
+				(uint32_t __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 const struct file_operations ouichefs_file_ops = {
-	.owner      = THIS_MODULE,
-	.llseek     = generic_file_llseek,
-	.read_iter  = generic_file_read_iter,
-	.write_iter = generic_file_write_iter
+	.owner          = THIS_MODULE,
+	.open           = ouichefs_file_open,
+	.release        = ouichefs_file_release,
+	.llseek         = generic_file_llseek,
+	.read_iter      = ouichefs_file_read_iter,
+	.write_iter     = ouichefs_file_write_iter,
+	.unlocked_ioctl = ouichefs_file_ioctl
 };
@@ -15,6 +15,9 @@
 #include <asm/io.h>
 #include <linux/kernel.h>
 #include <linux/delay.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
 
 #include "ouichefs.h"
 #include "ioctl_ouichefs.h"
@@ -24,6 +27,35 @@ static int major;
 dev_t devNo;
 struct class *pClass;
 
+/*
+ * Removal events waiting to be read from /dev/ouichefs. Producers are
+ * serialized by ouichefs_events_lock, the reader by ouichefs_events_mutex,
+ * kfifo needs no other locking with a single producer and consumer.
+ */
+static DEFINE_KFIFO(ouichefs_events, struct ouichefs_event, 256);
+static DEFINE_SPINLOCK(ouichefs_events_lock);
+static DEFINE_MUTEX(ouichefs_events_mutex);
+static DECLARE_WAIT_QUEUE_HEAD(ouichefs_events_wait);
+static atomic_long_t ouichefs_events_lost = ATOMIC_LONG_INIT(0);
+
+/*
+ * Record a removal event. If no one reads the events, the newest ones are
+ * dropped and counted, the reader gets an OUICHEFS_EVENT_LOST event instead.
+ */
+void ouichefs_event_push(const struct ouichefs_event *ev)
+{
+	if (!kfifo_in_spinlocked(&ouichefs_events, ev, 1,
+				 &ouichefs_events_lock))
+		atomic_long_inc(&ouichefs_events_lost);
+	wake_up_interruptible(&ouichefs_events_wait);
+}
+
+static bool ouichefs_events_ready(void)
+{
+	return !kfifo_is_empty(&ouichefs_events) ||
+	       atomic_long_read(&ouichefs_events_lost);
+}
+
 
 
 
@@ -50,6 +82,9 @@ struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
  */
 void ouichefs_kill_sb(struct super_block *sb)
 {
+	ouichefs_fblocks_stop(sb);
+	ouichefs_ttl_destroy(sb);
+	ouichefs_rmtree_destroy(sb);
 	kill_block_super(sb);
 
 	pr_info("unmounted disk\n");
@@ -68,17 +103,89 @@ static long unlocked_ioctl(struct file *f,
 				unsigned int cmd,
 				unsigned long arg)
 {
+	struct ouichefs_policy policy;
 
 	if (_IOC_TYPE(cmd) != IOC_MAGIC)
 		return -EINVAL;
 	switch (cmd) {
 	case QUICK_CLEAN:
-		ouichefs_fblocks(root_inode);
-		break;
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		ouichefs_fblocks(root_inode, NULL);
+		return 0;
+	case SET_POLICY:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&policy, (void __user *)arg, sizeof(policy)))
+			return -EFAULT;
+		return ouichefs_fblocks_set_policy(&policy);
+	case GET_POLICY:
+		ouichefs_fblocks_get_policy(&policy);
+		if (copy_to_user((void __user *)arg, &policy, sizeof(policy)))
+			return -EFAULT;
+		return 0;
 	default:
 		return -ENOTTY;
 	}
-	return -EINVAL;
+}
+
+/*
+ * Read as many whole removal events as fit in buf, preceded by an
+ * OUICHEFS_EVENT_LOST event if some were dropped since the last read. Blocks
+ * until an event is available unless the file was opened with O_NONBLOCK:
+ * another reader may take the events we were woken up for, so we wait again
+ * until we get some.
+ */
+static ssize_t ouichefs_events_read(struct file *f, char __user *buf,
+				    size_t len, loff_t *off)
+{
+	struct ouichefs_event lost = { .reason = OUICHEFS_EVENT_LOST };
+	unsigned int copied;
+	size_t done;
+	long nr_lost;
+	int ret;
+
+	if (len < sizeof(struct ouichefs_event))
+		return -EINVAL;
+
+	for (;;) {
+		if (mutex_lock_interruptible(&ouichefs_events_mutex))
+			return -ERESTARTSYS;
+		done = 0;
+		nr_lost = atomic_long_xchg(&ouichefs_events_lost, 0);
+		if (nr_lost) {
+			lost.lost = min_t(unsigned long, nr_lost, U32_MAX);
+			if (copy_to_user(buf, &lost, sizeof(lost))) {
+				atomic_long_add(nr_lost, &ouichefs_events_lost);
+				mutex_unlock(&ouichefs_events_mutex);
+				return -EFAULT;
+			}
+			done = sizeof(lost);
+		}
+		ret = kfifo_to_user(&ouichefs_events, buf + done, len - done,
+				    &copied);
+		mutex_unlock(&ouichefs_events_mutex);
+		done += copied;
+		if (done)
+			return done;
+		if (ret)
+			return ret;
+
+		if (f->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(ouichefs_events_wait,
+					       ouichefs_events_ready());
+		if (ret)
+			return ret;
+	}
+}
+
+static __poll_t ouichefs_events_poll(struct file *f, poll_table *wait)
+{
+	poll_wait(f, &ouichefs_events_wait, wait);
+	if (ouichefs_events_ready())
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
 }
 
 
@@ -95,7 +202,9 @@ static char *ouichefs_dev_devnode(struct device *dev, umode_t *mode)
  */
 struct file_operations fops = {
 
-	.unlocked_ioctl = unlocked_ioctl
+	.unlocked_ioctl = unlocked_ioctl,
+	.read = ouichefs_events_read,
+	.poll = ouichefs_events_poll
 };
 
 static int __init ouichefs_init(void)
@@ -109,6 +218,13 @@ static int __init ouichefs_init(void)
 		goto end;
 	}
 
+	ret = ouichefs_fblocks_init();
+	if (ret) {
+		pr_err("free blocks workqueue creation failed\n");
+		ouichefs_destroy_inode_cache();
+		goto end;
+	}
+
 	ret = register_filesystem(&ouichefs_file_system_type);
 	if (ret) {
 		pr_err("register_filesystem() failed\n");
@@ -165,6 +281,7 @@ static void __exit ouichefs_exit(void)
 	if (ret)
 		pr_err("unregister_filesystem() failed\n");
 
+	ouichefs_fblocks_exit();
 	ouichefs_destroy_inode_cache();
 
 	pr_info("module unloaded\n");
@@ -11,9 +11,12 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/workqueue.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
+#include "ioctl_ouichefs.h"
 
 static const struct inode_operations ouichefs_inode_ops;
 
@@ -21,108 +24,42 @@ static const struct inode_operations ouichefs_inode_ops;
 
 
 /*
- * Remove a link for a file. If link count is 0, destroy file in this way:
- *   - remove the file from its parent directory.
- *   - cleanup blocks containing data
- *   - cleanup file index block
- *   - cleanup inode
+ * Remove a file from its parent directory and add it to the orphan list. Its
+ * blocks and inode are freed in the background once it is not used anymore.
+ * If name is NULL, the entry is searched by inode number. The summaries of
+ * the ancestors are left to the caller, see ouichefs_summary_remove().
  */
-static int ouichefs_remove(struct inode *dir, struct inode *inode)
+int ouichefs_remove(struct inode *dir, struct inode *inode,
+		    const struct qstr *name)
 {
-	struct super_block *sb = dir->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
-	struct ouichefs_file_index_block *file_block = NULL;
-	uint32_t ino, bno;
-	int i, f_id = -1, nr_subs = 0;
-
-
-	ino = inode->i_ino;
-	bno = OUICHEFS_INODE(inode)->index_block;
+	int ret;
 
-	/* Read parent directory index */
-	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
-	if (!bh)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh->b_data;
 
-	/* Search for inode in parent index and get number of subfiles */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
-	}
-	nr_subs = i;
+	/* Blocks are freed once inode is not used anymore, even after a crash */
+	ret = ouichefs_orphan_add(inode);
+	if (ret)
+		return ret;
 
 	/* Remove file from parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id,
-			dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-
-	memset(&dir_block->files[nr_subs - 1],
-	       0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	ret = ouichefs_dir_del(dir, name ? (const char *)name->name : NULL,
+			       name ? name->len : 0, inode->i_ino);
+	if (ret) {
+		ouichefs_orphan_cancel(inode);
+		return ret;
+	}
 
 	/* Update inode stats */
 	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
 	if (S_ISDIR(inode->i_mode))
 		inode_dec_link_count(dir);
 	mark_inode_dirty(dir);
+	ouichefs_ttl_dequeue(inode);
+	if (OUICHEFS_INODE(inode)->flags & OUICHEFS_FL_COLD)
+		ouichefs_cold_release(inode);
 
-	/*
-	 * Cleanup pointed blocks if unlinking a file. If we fail to read the
-	 * index block, cleanup inode anyway and lose this file's blocks
-	 * forever. If we fail to scrub a data block,counter don't fail (too late
-	 * anyway), just put the block and continue.
-	 */
-	bh = sb_bread(sb, bno);
-	if (!bh)
-		goto clean_inode;
-
-	file_block = (struct ouichefs_file_index_block *)bh->b_data;
-	if (S_ISDIR(inode->i_mode))
-		goto scrub;
-
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
-
-		if(!file_block->blocks[i])
-			continue;
-		put_block(sbi, file_block->blocks[i]);
-		bh2 = sb_bread(sb, file_block->blocks[i]);
-		if (!bh2)
-			continue;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
-	}
-
-scrub:
-	/* Scrub index block */
-	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh);
-	brelse(bh);
-
-clean_inode:
-	/* Cleanup inode and mark dirty */
-	inode->i_blocks = 0;
-	OUICHEFS_INODE(inode)->index_block = 0;
-	inode->i_size = 0;
-	i_uid_write(inode, 0);
-	i_gid_write(inode, 0);
-	inode->i_mode = 0;
-	inode->i_ctime.tv_sec =
-		inode->i_mtime.tv_sec =
-		inode->i_atime.tv_sec = 0;
+	inode->i_ctime = current_time(inode);
+	clear_nlink(inode);
 	mark_inode_dirty(inode);
-	/* Free inode and index block from bitmap */
-	put_block(sbi, bno);
-	put_inode(sbi, ino);
 
 	return 0;
 }
@@ -130,15 +67,19 @@ clean_inode:
 /*
  * Remove a link for a file. If link count is 0, destroy file in this way:
  *   - remove the file from its parent directory.
- *   - cleanup blocks containing data
- *   - cleanup file index block
- *   - cleanup inode
+ *   - add the file to the orphan list
+ * Once the file is not used anymore, its blocks and inode are freed in the
+ * background (see orphan.c).
  */
 static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 {
 	struct inode *inode = d_inode(dentry);
+	int ret;
 
-	return ouichefs_remove(dir, inode);
+	ret = ouichefs_remove(dir, inode, &dentry->d_name);
+	if (!ret)
+		ouichefs_summary_remove(dir, inode);
+	return ret;
 }
 
 /*
@@ -196,6 +137,17 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
 	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->summary.oldest_mtime = le32_to_cpu(cinode->i_sum_mtime);
+	ci->summary.largest_size = le32_to_cpu(cinode->i_sum_size);
+	ci->summary.nr_blocks = le32_to_cpu(cinode->i_sum_blocks);
+	ci->summary.nr_files = le32_to_cpu(cinode->i_sum_files);
+	ci->heat_read = le32_to_cpu(cinode->i_heat_read);
+	ci->heat_write = le32_to_cpu(cinode->i_heat_write);
+	ci->heat_stamp = le32_to_cpu(cinode->i_heat_stamp);
+	ci->budget = le32_to_cpu(cinode->i_budget);
+	ci->ttl = le32_to_cpu(cinode->i_ttl);
+	ci->flags = le32_to_cpu(cinode->i_flags);
+	ci->cold_slot = le32_to_cpu(cinode->i_cold_slot);
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
@@ -217,6 +169,41 @@ failed:
 	return ERR_PTR(ret);
 }
 
+/* Inode store blocks read ahead at once, kept on the stack */
+#define OUICHEFS_READAHEAD_BATCH	128
+
+static int ouichefs_cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Start reading the inode store blocks of the nr inodes of inos, in
+ * increasing block order, so that the ouichefs_iget() calls that follow find
+ * them in the buffer cache instead of waiting for each one in turn.
+ */
+void ouichefs_readahead_inodes(struct super_block *sb, const uint32_t *inos,
+			       int nr)
+{
+	uint32_t blocks[OUICHEFS_READAHEAD_BATCH];
+	int i, n, done;
+
+	/* By batches, to keep the blocks on the stack */
+	for (done = 0; done < nr; done += n) {
+		n = min(nr - done, OUICHEFS_READAHEAD_BATCH);
+		for (i = 0; i < n; i++)
+			blocks[i] = inos[done + i] /
+				OUICHEFS_INODES_PER_BLOCK + 1;
+		sort(blocks, n, sizeof(uint32_t), ouichefs_cmp_u32, NULL);
+
+		for (i = 0; i < n; i++)
+			if (i == 0 || blocks[i] != blocks[i - 1])
+				sb_breadahead(sb, blocks[i]);
+	}
+}
+
 /**
  * ouichefs_fblocks_strategy_mtime - Fonction stratégie de libération de bloc
  * @a: inode victime
@@ -235,58 +222,459 @@ int (*ouichefs_fblocks_strategy)(struct inode *a, struct inode *b)
 	= ouichefs_fblocks_strategy_mtime;
 EXPORT_SYMBOL_GPL(ouichefs_fblocks_strategy);
 
+/**
+ * ouichefs_fblocks_strategy_bound_mtime - Borne de la stratégie mtime
+ * @victim: inode victime actuelle
+ * @sum: résumé d'un sous-arbre
+ *
+ * Renvoie une valeur positive si le sous-arbre peut contenir un fichier
+ * plus vieux que la victime, c'est-à-dire si son plus vieux mtime connu
+ * est antérieur à celui de la victime.
+ */
+int ouichefs_fblocks_strategy_bound_mtime(struct inode *victim,
+					  struct ouichefs_dir_summary *sum)
+{
+	return victim->i_mtime.tv_sec - sum->oldest_mtime;
+}
+
+/*
+ * Borne associée à la stratégie, NULL pour ne jamais élaguer. Une stratégie
+ * qui remplace ouichefs_fblocks_strategy doit aussi remplacer cette borne.
+ */
+int (*ouichefs_fblocks_strategy_bound)(struct inode *victim,
+				       struct ouichefs_dir_summary *sum)
+	= ouichefs_fblocks_strategy_bound_mtime;
+EXPORT_SYMBOL_GPL(ouichefs_fblocks_strategy_bound);
+
+/* Politique de score active, modifiable par l'ioctl SET_POLICY */
+static struct ouichefs_policy ouichefs_fblocks_policy;
+static DEFINE_SPINLOCK(ouichefs_fblocks_policy_lock);
+
+/**
+ * ouichefs_fblocks_score - Score d'un inode selon la politique active
+ * @inode: l'inode à évaluer
+ * @policy: les poids de la politique
+ *
+ * Les termes sont calculés sur 64 bits à partir de valeurs 32 bits et de
+ * poids bornés en valeur absolue par OUICHEFS_POLICY_WEIGHT_MAX (2^16) :
+ * chaque terme tient sur 49 bits signés et la somme des quatre ne peut pas
+ * déborder.
+ */
+static s64 ouichefs_fblocks_score(struct inode *inode,
+				  struct ouichefs_policy *policy)
+{
+	time64_t now = ktime_get_real_seconds();
+	s64 score = 0;
+
+	score += (s64)policy->w_size * (inode->i_size >> 10);
+	if (now > inode->i_mtime.tv_sec)
+		score += (s64)policy->w_age *
+			 (u32)((now - inode->i_mtime.tv_sec) / 3600);
+	if (now > inode->i_atime.tv_sec)
+		score += (s64)policy->w_atime *
+			 (u32)((now - inode->i_atime.tv_sec) / 3600);
+	if (policy->w_heat)
+		score += (s64)policy->w_heat * ouichefs_heat(inode);
+
+	return score;
+}
+
+/**
+ * ouichefs_fblocks_strategy_policy - Stratégie pilotée par SET_POLICY
+ * @a: inode victime
+ * @b: inode candidat
+ *
+ * Le candidat remporte la comparaison si son score est strictement
+ * supérieur à celui de la victime.
+ */
+int ouichefs_fblocks_strategy_policy(struct inode *a, struct inode *b)
+{
+	struct ouichefs_policy policy;
+	s64 score_a, score_b;
+
+	spin_lock(&ouichefs_fblocks_policy_lock);
+	policy = ouichefs_fblocks_policy;
+	spin_unlock(&ouichefs_fblocks_policy_lock);
+
+	score_a = ouichefs_fblocks_score(a, &policy);
+	score_b = ouichefs_fblocks_score(b, &policy);
+	if (score_b == score_a)
+		return 0;
+	return score_b > score_a ? 1 : -1;
+}
+
+/**
+ * ouichefs_fblocks_victim_score - Score d'une victime pour les événements
+ * @inode: la victime
+ *
+ * Renvoie le score de la victime si la stratégie par score est active, 0
+ * sinon : les autres stratégies ne font que comparer deux inodes.
+ */
+s64 ouichefs_fblocks_victim_score(struct inode *inode)
+{
+	struct ouichefs_policy policy;
+
+	if (ouichefs_fblocks_strategy != ouichefs_fblocks_strategy_policy)
+		return 0;
+	ouichefs_fblocks_get_policy(&policy);
+	return ouichefs_fblocks_score(inode, &policy);
+}
+
+/* Un poids est borné en valeur absolue par OUICHEFS_POLICY_WEIGHT_MAX */
+#define OUICHEFS_POLICY_WEIGHT_OK(w) \
+	((w) >= -OUICHEFS_POLICY_WEIGHT_MAX && (w) <= OUICHEFS_POLICY_WEIGHT_MAX)
+
+/**
+ * ouichefs_fblocks_set_policy - Change la politique de score
+ * @policy: les nouveaux poids
+ *
+ * Active la stratégie par score, ou restaure la stratégie mtime si tous
+ * les poids sont nuls. Prend effet dès la prochaine recherche de victime,
+ * sans recharger de module. Un poids négatif protège les fichiers ayant une
+ * grande valeur : avec w_heat négatif, les fichiers froids partent d'abord.
+ * Renvoie -EINVAL si un poids dépasse OUICHEFS_POLICY_WEIGHT_MAX en valeur
+ * absolue.
+ */
+int ouichefs_fblocks_set_policy(const struct ouichefs_policy *policy)
+{
+	bool reset = !policy->w_size && !policy->w_age &&
+		     !policy->w_atime && !policy->w_heat;
+
+	if (!OUICHEFS_POLICY_WEIGHT_OK(policy->w_size) ||
+	    !OUICHEFS_POLICY_WEIGHT_OK(policy->w_age) ||
+	    !OUICHEFS_POLICY_WEIGHT_OK(policy->w_atime) ||
+	    !OUICHEFS_POLICY_WEIGHT_OK(policy->w_heat))
+		return -EINVAL;
+
+	spin_lock(&ouichefs_fblocks_policy_lock);
+	ouichefs_fblocks_policy = *policy;
+	spin_unlock(&ouichefs_fblocks_policy_lock);
+
+	if (reset) {
+		ouichefs_fblocks_strategy = ouichefs_fblocks_strategy_mtime;
+		ouichefs_fblocks_strategy_bound =
+			ouichefs_fblocks_strategy_bound_mtime;
+	} else {
+		/* Les résumés ne bornent pas un score quelconque */
+		ouichefs_fblocks_strategy_bound = NULL;
+		ouichefs_fblocks_strategy = ouichefs_fblocks_strategy_policy;
+	}
+	pr_info("free blocks policy: size=%d age=%d atime=%d heat=%d\n",
+		policy->w_size, policy->w_age, policy->w_atime, policy->w_heat);
+
+	return 0;
+}
+
+/**
+ * ouichefs_fblocks_get_policy - Lit la politique de score active
+ * @policy: reçoit les poids actuels
+ */
+void ouichefs_fblocks_get_policy(struct ouichefs_policy *policy)
+{
+	spin_lock(&ouichefs_fblocks_policy_lock);
+	*policy = ouichefs_fblocks_policy;
+	spin_unlock(&ouichefs_fblocks_policy_lock);
+}
+
+/**
+ * ouichefs_summary_merge - Ajoute un fichier ou un sous-arbre à un résumé
+ * @sum: résumé à mettre à jour
+ * @inode: fichier ou dossier ajouté (NULL pour ne pas toucher aux bornes)
+ * @blocks: variation du nombre de blocs
+ * @files: variation du nombre de fichiers
+ *
+ * Les bornes ne sont jamais resserrées lors d'une suppression : un plus vieux
+ * mtime trop petit ou une plus grande taille trop grande reste une borne
+ * valide, elle sera corrigée au prochain parcours complet du sous-arbre.
+ */
+static void ouichefs_summary_merge(struct ouichefs_dir_summary *sum,
+				   struct inode *inode, int blocks, int files)
+{
+	uint32_t mtime, size;
+	bool empty = sum->nr_files == 0;
+
+	sum->nr_blocks += blocks;
+	sum->nr_files += files;
+	if (sum->nr_files == 0) {
+		sum->oldest_mtime = 0;
+		sum->largest_size = 0;
+		return;
+	}
+	if (!inode)
+		return;
+
+	if (S_ISREG(inode->i_mode)) {
+		mtime = inode->i_mtime.tv_sec;
+		size = inode->i_size;
+	} else if (OUICHEFS_INODE(inode)->summary.nr_files) {
+		mtime = OUICHEFS_INODE(inode)->summary.oldest_mtime;
+		size = OUICHEFS_INODE(inode)->summary.largest_size;
+	} else {
+		return;
+	}
+
+	if (empty || mtime < sum->oldest_mtime)
+		sum->oldest_mtime = mtime;
+	if (empty || size > sum->largest_size)
+		sum->largest_size = size;
+}
+
+/**
+ * ouichefs_summary_update - Répercute une modification sur les résumés
+ * @dir: dossier contenant le fichier modifié
+ * @inode: fichier ou dossier ajouté ou modifié, NULL pour une suppression
+ * @blocks: variation du nombre de blocs du sous-arbre
+ * @files: variation du nombre de fichiers du sous-arbre
+ *
+ * Met à jour le résumé de dir et de ses ancêtres jusqu'à la racine. La
+ * remontée s'arrête au premier résumé inchangé : les bornes d'un ancêtre
+ * englobent celles de ses descendants, une écriture qui ne change ni le
+ * nombre de blocs ni les bornes ne salit donc aucun dossier.
+ */
+void ouichefs_summary_update(struct inode *dir, struct inode *inode,
+			     int blocks, int files)
+{
+	struct ouichefs_dir_summary *sum, old;
+	struct dentry *dentry, *parent;
+	bool changed;
+
+	dentry = d_find_alias(dir);
+	for (;;) {
+		sum = &OUICHEFS_INODE(dir)->summary;
+		spin_lock(&dir->i_lock);
+		old = *sum;
+		ouichefs_summary_merge(sum, inode, blocks, files);
+		changed = memcmp(&old, sum, sizeof(old)) != 0;
+		spin_unlock(&dir->i_lock);
+		if (!changed)
+			break;
+		mark_inode_dirty(dir);
+
+		if (!dentry || IS_ROOT(dentry))
+			break;
+		parent = dget_parent(dentry);
+		dput(dentry);
+		dentry = parent;
+		dir = d_inode(dentry);
+	}
+	dput(dentry);
+}
+
+/**
+ * ouichefs_summary_remove - Retire un fichier ou un sous-arbre des résumés
+ * @dir: dossier qui contenait le fichier
+ * @inode: fichier ou dossier retiré de dir
+ *
+ * Pour un dossier, tout son sous-arbre est retiré des résumés de dir et de
+ * ses ancêtres.
+ */
+void ouichefs_summary_remove(struct inode *dir, struct inode *inode)
+{
+	int blocks = inode->i_blocks, files = 0;
+
+	if (S_ISREG(inode->i_mode)) {
+		files = 1;
+	} else if (S_ISDIR(inode->i_mode)) {
+		blocks += OUICHEFS_INODE(inode)->summary.nr_blocks;
+		files = OUICHEFS_INODE(inode)->summary.nr_files;
+	}
+	ouichefs_summary_update(dir, NULL, -blocks, -files);
+}
+
+/**
+ * ouichefs_budget_enforce - Applique les budgets des dossiers
+ * @dir: dossier dans lequel blocks blocs vont être alloués
+ * @blocks: nombre de blocs sur le point d'être alloués
+ * @locked: dossier dont l'appelant détient le i_rwsem, ou NULL
+ *
+ * Remonte de dir jusqu'à la racine. Pour chaque dossier ayant un budget que
+ * l'allocation ferait dépasser, libère des blocs en ne cherchant la victime
+ * que dans le sous-arbre de ce dossier, sans toucher au reste du système de
+ * fichiers. Renvoie -ENOSPC si un budget ne peut pas être respecté.
+ */
+int ouichefs_budget_enforce(struct inode *dir, int blocks,
+			   struct inode *locked)
+{
+	struct ouichefs_inode_info *ci;
+	struct dentry *dentry, *parent;
+	uint32_t used;
+	int ret = 0;
+
+	dentry = d_find_alias(dir);
+	for (;;) {
+		ci = OUICHEFS_INODE(dir);
+		while (ci->budget &&
+		       ci->summary.nr_blocks + blocks > ci->budget) {
+			used = ci->summary.nr_blocks;
+			if (ouichefs_fblocks(dir, locked) != 0 ||
+			    ci->summary.nr_blocks >= used) {
+				ret = -ENOSPC;
+				goto end;
+			}
+		}
+
+		if (!dentry || IS_ROOT(dentry))
+			break;
+		parent = dget_parent(dentry);
+		dput(dentry);
+		dentry = parent;
+		dir = d_inode(dentry);
+	}
+end:
+	dput(dentry);
+	return ret;
+}
+
 /**
  * ouichefs_iterate - Fonction générique d'itération dans un dossier
  * @dir: le dossier de la recherche
  * @action: la fonction à appliquer à chaque inode
- * @data: la donnée à passer à la fonction action
+ * @skip: la fonction décidant d'ignorer un sous-dossier, ou NULL
+ * @data: la donnée à passer aux fonctions action et skip
+ * @store: enregistre les résumés recalculés dans les dossiers parcourus
  * 
  * Itére sur tous les inodes d'un dossier et de ses sous-dossier et applique
  * la fonction action à chaque inode rencontrée avec comme paramètre 
  * supplémentaire data. La donnée data peut être une liste pour ajouter l'inode
  * ou un structure à manipuler, ou NULL si non nécessaire.
+ *
+ * Les fichiers du dossier sont visités avant ses sous-dossiers, afin que skip
+ * puisse élaguer les sous-arbres grâce à leur résumé. Le résumé de dir est
+ * recalculé à partir de ce qui a été parcouru, et n'est enregistré que si
+ * store est vrai : une simulation ne doit salir aucun inode.
  */
 void ouichefs_iterate(struct inode *dir,
-					void (*action)(struct inode *dir, struct inode *inode, void **data),
-					void **data)
+		      void (*action)(struct inode *dir, struct inode *inode,
+				     void **data),
+		      bool (*skip)(struct inode *dir, void **data),
+		      void **data, bool store)
 {
 	struct ouichefs_inode_info *ci_dir = OUICHEFS_INODE(dir);
 	struct super_block *sb = dir->i_sb;
 	struct inode *inode = NULL;
-	struct buffer_head *bh = NULL;
-	struct buffer_head *bh_dir = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
-	int i;
-
-	/* Read the directory index block on disk */
-	bh_dir = sb_bread(sb, ci_dir->index_block);
-	if (!bh_dir)
+	struct ouichefs_dir_summary sum = { 0 };
+	uint32_t *inos;
+	int i, nr, pass;
+
+	/* Read the directory entries on disk */
+	nr = ouichefs_dir_inos(sb, ci_dir->index_block, ci_dir->flags, &inos);
+	if (nr < 0)
 		return;
-	dblock = (struct ouichefs_dir_block *)bh_dir->b_data;
+	ouichefs_readahead_inodes(sb, inos, nr);
+
+	/* Pass 0: regular files, pass 1: subdirectories */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < nr; i++) {
+			inode = ouichefs_iget(sb, inos[i]);
+			if (IS_ERR(inode))
+				continue;
+
+			if (pass == 1 && S_ISDIR(inode->i_mode)) {
+				if (skip == NULL || !skip(inode, data))
+					ouichefs_iterate(inode, action, skip,
+							 data, store);
+				ouichefs_summary_merge(&sum, inode,
+					OUICHEFS_INODE(inode)->summary.nr_blocks
+					+ inode->i_blocks,
+					OUICHEFS_INODE(inode)->summary.nr_files);
+			} else if (pass == 0 && S_ISREG(inode->i_mode)) {
+				ouichefs_summary_merge(&sum, inode,
+						       inode->i_blocks, 1);
+				/* action takes its own references to keep */
+				if (action != NULL)
+					action(dir, inode, data);
+			}
+			iput(inode);
+		}
+	}
+	kvfree(inos);
+
+	/* Store the summary computed from this walk */
+	if (store && memcmp(&sum, &ci_dir->summary, sizeof(sum))) {
+		spin_lock(&dir->i_lock);
+		ci_dir->summary = sum;
+		spin_unlock(&dir->i_lock);
+		mark_inode_dirty(dir);
+	}
+}
 
-	/* Search for the file in directory */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
-			break;
+/**
+ * ouichefs_fblocks_skip - Élagage des sous-dossiers lors de la recherche
+ * @dir: le sous-dossier à visiter
+ * @data: la victime de la recherche
+ *
+ * Renvoie vrai si le résumé de dir garantit qu'aucun fichier de son
+ * sous-arbre ne peut remplacer la victime actuelle.
+ */
+bool ouichefs_fblocks_skip(struct inode *dir, void **data)
+{
+	struct ouichefs_inode_kinship **victim;
 
-		inode = ouichefs_iget(sb, f->inode);
+	victim = (struct ouichefs_inode_kinship **) data;
+	if ((*victim)->inode == NULL || ouichefs_fblocks_strategy_bound == NULL)
+		return false;
 
-		if (S_ISDIR(inode->i_mode)) {
-			ouichefs_iterate(inode, action, data);
-		} else if (S_ISREG(inode->i_mode)) {
-			iput(inode);
-			if (action != NULL) {
-				action(dir, inode, data);
-			}
-		}
+	return ouichefs_fblocks_strategy_bound((*victim)->inode,
+				&OUICHEFS_INODE(dir)->summary) <= 0;
+}
 
-		brelse(bh);
-		/* Unlock the inode to make it usable */
+/**
+ * ouichefs_fblocks_busy - Indique si un fichier ne doit pas être supprimé
+ * @inode: le fichier candidat
+ * @refs: nombre de références sur l'inode détenues par l'appelant
+ *
+ * Un fichier est protégé s'il est épinglé, ouvert ou fermé depuis moins de
+ * OUICHEFS_BUSY_GRACE secondes, projeté en mémoire, s'il a des pages sales
+ * ou en cours d'écriture, ou si quelqu'un d'autre que son dentry et
+ * l'appelant détient une référence sur l'inode.
+ */
+bool ouichefs_fblocks_busy(struct inode *inode, int refs)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct address_space *mapping = inode->i_mapping;
+	bool busy;
+
+	if (ci->flags & OUICHEFS_FL_PINNED)
+		return true;
+	if (atomic_read(&ci->nr_open) ||
+	    ktime_get_real_seconds() - ci->close_stamp < OUICHEFS_BUSY_GRACE)
+		return true;
+	if (mapping_mapped(mapping) ||
+	    mapping_tagged(mapping, PAGECACHE_TAG_DIRTY) ||
+	    mapping_tagged(mapping, PAGECACHE_TAG_WRITEBACK))
+		return true;
+
+	spin_lock(&inode->i_lock);
+	if (!hlist_empty(&inode->i_dentry))
+		refs++;
+	busy = atomic_read(&inode->i_count) > refs;
+	spin_unlock(&inode->i_lock);
+
+	return busy;
+}
 
+/**
+ * ouichefs_fblocks_hold - Remplace la victime en prenant ses références
+ * @victim: la victime à remplacer
+ * @dir: le dossier contenant le nouveau fichier, ou NULL
+ * @inode: le nouveau fichier, ou NULL pour seulement relâcher
+ *
+ * La victime garde une référence sur son fichier et son dossier, qui
+ * peuvent sinon être libérés dès que le parcours les relâche.
+ */
+static void ouichefs_fblocks_hold(struct ouichefs_inode_kinship *victim,
+				  struct inode *dir, struct inode *inode)
+{
+	if (inode) {
+		ihold(dir);
+		ihold(inode);
 	}
-	brelse(bh_dir);
+	if (victim->inode) {
+		iput(victim->parent);
+		iput(victim->inode);
+	}
+	victim->parent = dir;
+	victim->inode = inode;
 }
 
 /**
@@ -306,71 +694,500 @@ void ouichefs_fblocks_action(struct inode *dir,
 	struct ouichefs_inode_kinship **victim;
 	int ret = 0;
 
- 	if (inode->i_count.counter > 1) {
-		pr_info("inode used %d\n", inode->i_count.counter);
+	/* Le parcours détient une référence sur inode */
+	if (ouichefs_fblocks_busy(inode, 1))
 		return;
-	} 
 
 	victim = (struct ouichefs_inode_kinship **) data;
 
+	/* Un fichier déjà sur le tier froid ne libère plus de bloc */
+	if ((*victim)->demote &&
+	    (OUICHEFS_INODE(inode)->flags & OUICHEFS_FL_COLD))
+		return;
+
 	if ((*victim)->inode == NULL)
 		ret = 1;
 	else if (ouichefs_fblocks_strategy != NULL)
 		ret = ouichefs_fblocks_strategy((*victim)->inode, inode);
 
-	if (ret > 0) {
-		(*victim)->parent = dir;
-		(*victim)->inode = inode;
+	if (ret > 0)
+		ouichefs_fblocks_hold(*victim, dir, inode);
+}
+
+/*
+ * Workqueue des recherches parallèles et de l'éviction en arrière-plan. Elle
+ * est dédiée car l'éviction est lancée par les allocations et attend ses
+ * workers : les mettre sur une workqueue partagée pourrait les bloquer
+ * derrière des travaux qui attendent eux-mêmes une allocation.
+ */
+static struct workqueue_struct *ouichefs_fblocks_wq;
+
+int ouichefs_fblocks_init(void)
+{
+	ouichefs_fblocks_wq = alloc_workqueue("ouichefs_fblocks",
+					      WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!ouichefs_fblocks_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+void ouichefs_fblocks_exit(void)
+{
+	destroy_workqueue(ouichefs_fblocks_wq);
+}
+
+/* Recherche d'une victime dans un sous-dossier, confiée à un worker */
+struct ouichefs_fblocks_work {
+	struct work_struct work;
+	struct list_head list;
+	struct inode *dir;
+	struct ouichefs_inode_kinship victim;
+};
+
+static void ouichefs_fblocks_worker(struct work_struct *work)
+{
+	struct ouichefs_fblocks_work *w =
+		container_of(work, struct ouichefs_fblocks_work, work);
+	struct ouichefs_inode_kinship *victim = &w->victim;
+
+	if (ouichefs_fblocks_skip(w->dir, (void **) &victim))
+		return;
+	ouichefs_iterate(w->dir, ouichefs_fblocks_action,
+			 ouichefs_fblocks_skip, (void **) &victim, true);
+}
+
+/**
+ * ouichefs_fblocks_parallel - Recherche parallèle de la victime
+ * @dir: inode racine de la recherche
+ * @victim: reçoit la meilleure victime
+ * @works: reçoit les recherches lancées, à libérer après la suppression
+ *
+ * Traite les fichiers de dir, puis lance la recherche dans chaque
+ * sous-dossier sur un worker, chacun partant de la meilleure victime parmi
+ * les fichiers de dir pour élaguer. Les victimes des workers sont ensuite
+ * départagées avec la stratégie. Renvoie -EAGAIN si dir a moins de deux
+ * sous-dossiers, la recherche séquentielle suffit alors.
+ *
+ * Seul le premier niveau est parallélisé : chaque worker parcourt son
+ * sous-dossier séquentiellement, un arbre dont la racine n'a qu'un
+ * sous-dossier est donc parcouru sans parallélisme.
+ */
+static int ouichefs_fblocks_parallel(struct inode *dir,
+				     struct ouichefs_inode_kinship *victim,
+				     struct list_head *works)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_inode_info *ci_dir = OUICHEFS_INODE(dir);
+	struct ouichefs_fblocks_work *w;
+	struct inode *inode;
+	uint32_t *inos;
+	int i, nr, nr_dirs = 0;
+
+	nr = ouichefs_dir_inos(sb, ci_dir->index_block, ci_dir->flags, &inos);
+	if (nr < 0)
+		return nr;
+	ouichefs_readahead_inodes(sb, inos, nr);
+
+	/* Les fichiers d'abord, pour avoir une victime pour élaguer */
+	for (i = 0; i < nr; i++) {
+		inode = ouichefs_iget(sb, inos[i]);
+		if (IS_ERR(inode))
+			continue;
+		if (S_ISDIR(inode->i_mode))
+			nr_dirs++;
+		else if (S_ISREG(inode->i_mode))
+			ouichefs_fblocks_action(dir, inode, (void **) &victim);
+		iput(inode);
+	}
+	if (nr_dirs < 2) {
+		kvfree(inos);
+		return -EAGAIN;
+	}
+
+	for (i = 0; i < nr; i++) {
+		inode = ouichefs_iget(sb, inos[i]);
+		if (IS_ERR(inode))
+			continue;
+		if (!S_ISDIR(inode->i_mode)) {
+			iput(inode);
+			continue;
+		}
+
+		w = kmalloc(sizeof(*w), GFP_KERNEL);
+		if (!w) {
+			/* On parcourt ce dossier nous-même */
+			ouichefs_iterate(inode, ouichefs_fblocks_action,
+					 ouichefs_fblocks_skip,
+					 (void **) &victim, true);
+			iput(inode);
+			continue;
+		}
+		INIT_WORK(&w->work, ouichefs_fblocks_worker);
+		w->dir = inode;
+		w->victim = *victim;
+		if (victim->inode) {
+			ihold(victim->parent);
+			ihold(victim->inode);
+		}
+		list_add_tail(&w->list, works);
+		queue_work(ouichefs_fblocks_wq, &w->work);
+	}
+	kvfree(inos);
+
+	/* Garde la meilleure des victimes trouvées par les workers */
+	list_for_each_entry(w, works, list) {
+		flush_work(&w->work);
+		if (w->victim.inode == NULL)
+			continue;
+		if (victim->inode == NULL ||
+		    (ouichefs_fblocks_strategy != NULL &&
+		     ouichefs_fblocks_strategy(victim->inode,
+					       w->victim.inode) > 0))
+			ouichefs_fblocks_hold(victim, w->victim.parent,
+					      w->victim.inode);
+		ouichefs_fblocks_hold(&w->victim, NULL, NULL);
+	}
+
+	return 0;
+}
+
+/**
+ * ouichefs_fblocks_delete - Supprime un fichier choisi par le module
+ * @dir: le dossier contenant le fichier, verrouillé par l'appelant
+ * @inode: le fichier à supprimer
+ *
+ * Supprime à partir du dentry s'il existe, afin que le dcache reste
+ * cohérent, sinon supprime directement l'inode. La victime a été choisie
+ * sans verrou : renvoie -ENOENT si elle a été supprimée ou déplacée hors
+ * de dir depuis.
+ */
+int ouichefs_fblocks_delete(struct inode *dir, struct inode *inode)
+{
+	struct dentry *dentry;
+	struct inode *delegated_inode = NULL;
+	int ret;
+
+	WARN_ON_ONCE(!inode_is_locked(dir));
+
+	dentry = d_find_any_alias(inode);
+	if (dentry == NULL) {
+		/*
+		 * Si un dentry n'existe pas pour l'inode victime on supprime
+		 * simplement. La référence prise garantit que le dernier iput
+		 * libère l'inode, au lieu de la laisser dans le cache.
+		 */
+		if (!igrab(inode))
+			return -ENOENT;
+		inode_lock(inode);
+		if (inode->i_nlink) {
+			ret = ouichefs_remove(dir, inode, NULL);
+			if (!ret)
+				ouichefs_summary_remove(dir, inode);
+		} else {
+			ret = -ENOENT;
+		}
+		inode_unlock(inode);
+		iput(inode);
+		return ret;
+	}
+
+	/* Sinon on supprime à partir du dentry, s'il est toujours dans dir */
+	if (d_unhashed(dentry) || d_inode(dentry->d_parent) != dir)
+		ret = -ENOENT;
+	else
+		ret = vfs_unlink(dir, dentry, &delegated_inode);
+	dput(dentry);
+
+	return ret;
+}
+
+/* Classement des meilleures victimes lors d'une simulation */
+struct ouichefs_ranking {
+	unsigned int nr;
+	unsigned int max;
+	struct ouichefs_inode_kinship *victims; /* Meilleure victime en tête */
+};
+
+/**
+ * ouichefs_dry_run_action - Classe un inode lors d'une simulation
+ * @dir: l'inode du dossier de l'inode courant
+ * @inode: l'inode courant
+ * @data: le classement en cours
+ *
+ * Insère l'inode dans le classement à sa place selon la stratégie, en
+ * gardant une référence dessus, et sort la dernière victime si le
+ * classement est plein.
+ */
+static void ouichefs_dry_run_action(struct inode *dir,
+				    struct inode *inode,
+				    void **data)
+{
+	struct ouichefs_ranking *ranking = (struct ouichefs_ranking *) *data;
+	struct ouichefs_inode_kinship *victims = ranking->victims;
+	unsigned int pos;
+
+	/* Le parcours détient une référence sur inode */
+	if (ouichefs_fblocks_busy(inode, 1))
+		return;
+
+	/* Première victime que l'inode bat */
+	for (pos = 0; pos < ranking->nr; pos++)
+		if (ouichefs_fblocks_strategy != NULL &&
+		    ouichefs_fblocks_strategy(victims[pos].inode, inode) > 0)
+			break;
+	if (pos == ranking->max)
+		return;
+
+	ihold(dir);
+	ihold(inode);
+	if (ranking->nr == ranking->max) {
+		ranking->nr--;
+		iput(victims[ranking->nr].parent);
+		iput(victims[ranking->nr].inode);
 	}
+	memmove(&victims[pos + 1], &victims[pos],
+		(ranking->nr - pos) * sizeof(*victims));
+	victims[pos].parent = dir;
+	victims[pos].inode = inode;
+	ranking->nr++;
+}
+
+/**
+ * ouichefs_dry_run_skip - Élagage des sous-dossiers lors d'une simulation
+ * @dir: le sous-dossier à visiter
+ * @data: le classement en cours
+ *
+ * Une fois le classement plein, ignore les sous-arbres qui ne peuvent pas
+ * contenir de meilleure victime que la dernière du classement.
+ */
+static bool ouichefs_dry_run_skip(struct inode *dir, void **data)
+{
+	struct ouichefs_ranking *ranking = (struct ouichefs_ranking *) *data;
+
+	if (ranking->nr < ranking->max || ouichefs_fblocks_strategy_bound == NULL)
+		return false;
+
+	return ouichefs_fblocks_strategy_bound(
+			ranking->victims[ranking->nr - 1].inode,
+			&OUICHEFS_INODE(dir)->summary) <= 0;
+}
+
+/**
+ * ouichefs_fblocks_dry_run - Simule la libération de blocs
+ * @dir: inode racine de la recherche
+ * @candidates: reçoit les victimes, la meilleure en premier
+ * @max: nombre maximal de victimes
+ *
+ * Classe les fichiers du sous-arbre de dir comme le ferait
+ * ouichefs_fblocks, sans rien supprimer. Renvoie le nombre de victimes
+ * écrites dans candidates ou une erreur.
+ */
+int ouichefs_fblocks_dry_run(struct inode *dir,
+			     struct ouichefs_candidate *candidates,
+			     unsigned int max)
+{
+	struct ouichefs_ranking ranking = { .nr = 0, .max = max };
+	struct ouichefs_ranking *data = &ranking;
+	struct inode *inode;
+	unsigned int i;
+
+	if (!max)
+		return 0;
+	ranking.victims = kmalloc_array(max, sizeof(*ranking.victims),
+					GFP_KERNEL);
+	if (!ranking.victims)
+		return -ENOMEM;
+
+	ouichefs_iterate(dir, ouichefs_dry_run_action, ouichefs_dry_run_skip,
+			 (void **) &data, false);
+
+	for (i = 0; i < ranking.nr; i++) {
+		inode = ranking.victims[i].inode;
+		candidates[i].ino = inode->i_ino;
+		candidates[i].parent = ranking.victims[i].parent->i_ino;
+		candidates[i].size = inode->i_size;
+		candidates[i].blocks = inode->i_blocks;
+		candidates[i].mtime = inode->i_mtime.tv_sec;
+		candidates[i].atime = inode->i_atime.tv_sec;
+		candidates[i].score = ouichefs_fblocks_victim_score(inode);
+		iput(ranking.victims[i].parent);
+		iput(inode);
+	}
+	kfree(ranking.victims);
+
+	return ranking.nr;
 }
 
 /**
  * ouichefs_fblocks - Lance la libération de blocs
  * @dir: inode racine de la recherche
+ * @locked: dossier dont l'appelant détient déjà le i_rwsem, ou NULL
  * 
  * Recherche le fichier victime qui valide la stratégie mis en place 
  * avec la fonction 'ouichefs_fblocks_strategy' et le supprime pour
- * libérer des blocs
+ * libérer des blocs, ou le déplace sur le tier froid s'il y en a un
+ *
+ * Le dossier de la victime doit être verrouillé pour la supprimer. Comme
+ * l'appelant peut déjà détenir d'autres verrous (page, inode en écriture),
+ * on ne fait qu'essayer de le prendre et on renvoie -EBUSY en cas d'échec,
+ * sauf si c'est locked, déjà verrouillé par l'appelant.
+ *
+ * Les blocs d'un fichier supprimé sont libérés par le worker des orphelins
+ * une fois sa dernière référence relâchée : on l'attend avant de rendre la
+ * main, afin que l'appelant voie les blocs libérés en revérifiant le seuil
+ * et ne supprime pas d'autres fichiers en attendant.
  */
-int ouichefs_fblocks(struct inode *dir)
+int ouichefs_fblocks(struct inode *dir, struct inode *locked)
 {
 	struct ouichefs_inode_kinship *victim;
-	struct dentry *dentry;
-	struct inode *delegated_inode = NULL;
+	struct ouichefs_event ev = { .reason = OUICHEFS_EVENT_EVICT };
+	struct ouichefs_fblocks_work *w, *tmp;
+	LIST_HEAD(works);
+	u64 start = ktime_get_ns();
+	bool deleted = false;
+	int demoted = -ENODEV;
 	int ret = 0;
 
 	victim = (struct ouichefs_inode_kinship*)
 		kmalloc(sizeof(struct ouichefs_inode_kinship), GFP_KERNEL);
+	if (!victim)
+		return -ENOMEM;
 	victim->parent = NULL;
 	victim->inode = NULL;
+	victim->demote = OUICHEFS_SB(dir->i_sb)->cold != NULL;
 
-	ouichefs_iterate(dir, ouichefs_fblocks_action, (void**) &victim);
+	if (ouichefs_fblocks_parallel(dir, victim, &works))
+		ouichefs_iterate(dir, ouichefs_fblocks_action,
+				 ouichefs_fblocks_skip, (void**) &victim,
+				 true);
 
 	/* Aucune victime trouvée, cas censé ne jamais arrivé */
-	if (victim->inode == NULL)
-		return -1;
+	if (victim->inode == NULL) {
+		ret = -1;
+		goto free_works;
+	}
+
+	pr_debug("victim inode %lu in directory %lu\n",
+		 victim->inode->i_ino, victim->parent->i_ino);
 
-	pr_info("final victim=%p, count=%d\n", victim,
-		victim->inode->i_count.counter);
+	ev.ino = victim->inode->i_ino;
+	ev.parent = victim->parent->i_ino;
+	ev.size = victim->inode->i_size;
+	ev.age = ktime_get_real_seconds() - victim->inode->i_mtime.tv_sec;
+	ev.score = ouichefs_fblocks_victim_score(victim->inode);
 
-	dentry = d_find_any_alias(victim->inode);
-	pr_info("victim name=%s, ptr=%p\n", dentry->d_iname, dentry);
- 	if (dentry == NULL) {
-		/* Si un dentry n'existe pas pour l'inode victime on supprime simplement */
-		inode_lock(victim->inode);
-		ouichefs_remove(victim->parent, victim->inode);
-		inode_unlock(victim->inode);
+	if (victim->parent != locked &&
+	    !inode_trylock(victim->parent)) {
+		ret = -EBUSY;
+		goto free_works;
 	}
-	else {
-		/* Sinon on supprime à partir du dentry */
-		vfs_unlink(victim->parent, dentry, &delegated_inode);
+
+	/*
+	 * Si le déplacement échoue, on supprime, sauf si la victime a été
+	 * ouverte entre temps
+	 */
+	if (victim->demote)
+		demoted = ouichefs_cold_demote(victim->parent, victim->inode);
+	if (!demoted) {
+		ev.reason = OUICHEFS_EVENT_DEMOTE;
+		ev.latency_ns = ktime_get_ns() - start;
+		ouichefs_event_push(&ev);
+	} else if (demoted == -EBUSY) {
+		ret = -EBUSY;
+	} else if (!ouichefs_fblocks_delete(victim->parent, victim->inode)) {
+		deleted = true;
+		ev.latency_ns = ktime_get_ns() - start;
+		ouichefs_event_push(&ev);
 	}
 
-	dput(dentry);
-	
+	if (victim->parent != locked)
+		inode_unlock(victim->parent);
+
+free_works:
+	list_for_each_entry_safe(w, tmp, &works, list) {
+		iput(w->dir);
+		kfree(w);
+	}
+	ouichefs_fblocks_hold(victim, NULL, NULL);
+	kfree(victim);
+
+	/* Victime relâchée : attend la libération de ses blocs */
+	if (deleted)
+		ouichefs_orphan_flush(dir->i_sb);
+
 	return ret;
 }
 
+/**
+ * ouichefs_fblocks_watermark - Applique le seuil de blocs libres
+ * @sb: le système de fichiers
+ * @blocks: nombre de blocs sur le point d'être alloués
+ * @locked: dossier dont l'appelant détient le i_rwsem, ou NULL
+ *
+ * Tant que l'allocation ferait passer les blocs libres sous
+ * OUICHEFS_WATERMARK, évince des fichiers de tout le système de fichiers.
+ * L'éviction verrouille le dossier de la victime et attend la libération de
+ * ses blocs : à appeler avant de prendre les verrous d'inodes et de pages.
+ * S'arrête dès qu'une éviction ne libère rien.
+ */
+void ouichefs_fblocks_watermark(struct super_block *sb, int blocks,
+				struct inode *locked)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t free;
+
+	while (sbi->nr_free_blocks < OUICHEFS_WATERMARK(sbi) + blocks) {
+		free = sbi->nr_free_blocks;
+		if (ouichefs_fblocks(d_inode(sb->s_root), locked) != 0 ||
+		    sbi->nr_free_blocks <= free)
+			break;
+	}
+}
+
+/*
+ * Éviction en arrière-plan, lancée par get_free_block() pour les
+ * allocations faites sous verrou (pages, inodes, dossiers).
+ */
+void ouichefs_fblocks_watermark_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, watermark_work);
+	struct super_block *sb = sbi->sb;
+
+	if (!sb->s_root || sb_rdonly(sb) || !sb_start_write_trylock(sb))
+		return;
+	ouichefs_fblocks_watermark(sb, 0, NULL);
+	sb_end_write(sb);
+}
+
+/**
+ * ouichefs_fblocks_kick - Lance l'éviction en arrière-plan
+ * @sbi: le système de fichiers passé sous le seuil
+ *
+ * Appelée avec bitmap_lock tenu, ce qui l'ordonne avec
+ * ouichefs_fblocks_stop(). Sans effet si l'éviction est déjà lancée.
+ */
+void ouichefs_fblocks_kick(struct ouichefs_sb_info *sbi)
+{
+	queue_work(ouichefs_fblocks_wq, &sbi->watermark_work);
+}
+
+/**
+ * ouichefs_fblocks_stop - Arrête l'éviction en arrière-plan
+ * @sb: le système de fichiers démonté
+ */
+void ouichefs_fblocks_stop(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!sbi)
+		return;
+	spin_lock(&sbi->bitmap_lock);
+	sbi->watermark_off = true;
+	spin_unlock(&sbi->bitmap_lock);
+	cancel_work_sync(&sbi->watermark_work);
+}
+
 /*
  * Look for dentry in dir.
  * Fill dentry with NULL if not in dir, with the corresponding inode if found.
@@ -380,40 +1197,27 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 				      unsigned int flags)
 {
 	struct super_block *sb = dir->i_sb;
-	struct ouichefs_inode_info *ci_dir = OUICHEFS_INODE(dir);
 	struct inode *inode = NULL;
-	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
-	int i;
+	uint32_t ino;
+	int ret;
 
 
 	/* Check filename length */
 	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
 		return ERR_PTR(-ENAMETOOLONG);
 
-	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return ERR_PTR(-EIO);
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	/* Search for the file in the directory index */
+	ret = ouichefs_dir_find(dir, dentry->d_name.name, dentry->d_name.len,
+				&ino);
+	if (!ret)
+		inode = ouichefs_iget(sb, ino);
+	else if (ret != -ENOENT)
+		return ERR_PTR(ret);
 
-	/* Search for the file in directory */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
-			break;
-		if (!strncmp(f->filename, dentry->d_name.name,
-			     OUICHEFS_FILENAME_LEN)) {
-			inode = ouichefs_iget(sb, f->inode);
-			break;
-		}
-	}
-	brelse(bh);
-
-	/* Update directory access time */
-	dir->i_atime = current_time(dir);
-	mark_inode_dirty(dir);
+	/*
+	 * A lookup does not update the access time of dir: readdir does,
+	 * through the VFS, which honors noatime, relatime and lazytime.
+	 */
 
 	/* Fill the dentry with the inode */
 	d_add(dentry, inode);
@@ -464,6 +1268,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		goto put_inode;
 	}
 	ci->index_block = bno;
+	memset(&ci->summary, 0, sizeof(struct ouichefs_dir_summary));
 
 	/* Initialize inode */
 	inode_init_owner(inode, dir, mode);
@@ -480,6 +1285,11 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	}
 
 	inode->i_ctime = inode->i_atime = inode->i_mtime = current_time(inode);
+	ci->heat_read = ci->heat_write = 0;
+	ci->heat_stamp = inode->i_mtime.tv_sec;
+	ci->budget = 0;
+	ci->ttl = OUICHEFS_INODE(dir)->ttl;
+	ci->flags = 0;
 
 	return inode;
 
@@ -493,74 +1303,65 @@ put_ino:
 
 /*
  * Create a file or directory in this way:
- *   - check filename length and if the parent directory is not full
+ *   - check filename length
  *   - create the new inode (allocate inode and blocks)
  *   - cleanup index block of the new inode
- *   - add new file/directory in parent index
+ *   - add new file/directory in parent directory, which grows if needed
  */
 static int ouichefs_create(struct inode *dir, struct dentry *dentry,
 			   umode_t mode, bool excl)
 {
 	struct super_block *sb;
 	struct inode *inode;
-	struct ouichefs_inode_info *ci_dir;
-	struct ouichefs_dir_block *dblock;
 	char *fblock;
-	struct buffer_head *bh, *bh2;
-	int ret = 0, i;
+	struct buffer_head *bh2;
+	int ret = 0;
 
 
 	/* Check filename length */
 	if (strlen(dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
 		return -ENAMETOOLONG;
-
-	/* Read parent directory index */
-	ci_dir = OUICHEFS_INODE(dir);
 	sb = dir->i_sb;
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Check if parent directory is full */
-	if (dblock->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
-		/* Free blocks */
-		if (ouichefs_fblocks(dir) != 0) {
-			ret = -EMLINK;
-			goto end;
-		}
-	}
+
+	/*
+	 * Make room for the index block in the budgets of dir's ancestors,
+	 * and above the free blocks watermark. The VFS holds dir locked,
+	 * victims in other directories are only removed if their parent is
+	 * not locked (see ouichefs_fblocks()).
+	 */
+	ret = ouichefs_budget_enforce(dir, 1, dir);
+	if (ret)
+		return ret;
+	ouichefs_fblocks_watermark(sb, 1, dir);
 
 	/* Get a new free inode */
 	inode = ouichefs_new_inode(dir, mode);
-	if (IS_ERR(inode)) {
-		ret = PTR_ERR(inode);
-		goto end;
-	}
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
 
 	/*
 	 * Scrub index_block for new file/directory to avoid previous data
-	 * messing with new file/directory.
+	 * messing with new file/directory. Freed blocks are not scrubbed, and
+	 * the old content is overwritten anyway: no need to read it.
 	 */
-	bh2 = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+	bh2 = sb_getblk(sb, OUICHEFS_INODE(inode)->index_block);
 	if (!bh2) {
 		ret = -EIO;
 		goto iput;
 	}
+	lock_buffer(bh2);
 	fblock = (char *)bh2->b_data;
 	memset(fblock, 0, OUICHEFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh2);
+	unlock_buffer(bh2);
 	mark_buffer_dirty(bh2);
 	brelse(bh2);
 
-	/* Find first free slot in parent index and register new inode */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
-		if (dblock->files[i].inode == 0)
-			break;
-	dblock->files[i].inode = inode->i_ino;
-	strncpy(dblock->files[i].filename,
-		dentry->d_name.name, OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	/* Register new inode in parent directory */
+	ret = ouichefs_dir_add(dir, dentry->d_name.name, dentry->d_name.len,
+			       inode->i_ino, OUICHEFS_DT(mode));
+	if (ret)
+		goto iput;
 
 	/* Update stats and mark dir and new inode dirty */
 	mark_inode_dirty(inode);
@@ -568,6 +1369,9 @@ static int ouichefs_create(struct inode *dir, struct dentry *dentry,
 	if (S_ISDIR(mode))
 		inode_inc_link_count(dir);
 	mark_inode_dirty(dir);
+	ouichefs_summary_update(dir, inode, inode->i_blocks,
+				S_ISREG(mode) ? 1 : 0);
+	ouichefs_ttl_queue(dir, inode);
 
 	/* setup dentry */
 	d_instantiate(dentry, inode);
@@ -578,8 +1382,6 @@ iput:
 	put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
 	put_inode(OUICHEFS_SB(sb), inode->i_ino);
 	iput(inode);
-end:
-	brelse(bh);
 	return ret;
 }
 
@@ -587,13 +1389,9 @@ static int ouichefs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			   struct inode *new_dir, struct dentry *new_dentry,
 			   unsigned int flags)
 {
-	struct super_block *sb = old_dir->i_sb;
-	struct ouichefs_inode_info *ci_old = OUICHEFS_INODE(old_dir);
-	struct ouichefs_inode_info *ci_new = OUICHEFS_INODE(new_dir);
 	struct inode *src = d_inode(old_dentry);
-	struct buffer_head *bh_old = NULL, *bh_new = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
-	int i, f_id = -1, new_pos = -1, ret, nr_subs, f_pos = -1;
+	int ret;
+	int sum_blocks, sum_files;
 
 
 	/* fail with these unsupported flags */
@@ -604,66 +1402,33 @@ static int ouichefs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	if (strlen(new_dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
 		return -ENAMETOOLONG;
 
-	/* Fail if new_dentry exists or if new_dir is full */
-	bh_new = sb_bread(sb, ci_new->index_block);
-	if (!bh_new)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_new->b_data;
-
-	/* Check if new parent directory is full */
-	if (dir_block->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
-		/* Free blocks */
-		if (ouichefs_fblocks(new_dir) != 0) {
-			ret = -EMLINK;
-			goto relse_new;
-		}
-	}
+	/* Fail if new_dentry exists */
+	ret = ouichefs_dir_find(new_dir, new_dentry->d_name.name,
+				new_dentry->d_name.len, NULL);
+	if (!ret)
+		return -EEXIST;
+	if (ret != -ENOENT)
+		return ret;
+
+	/* insert in new parent directory, it may be in another leaf */
+	ret = ouichefs_dir_add(new_dir, new_dentry->d_name.name,
+			       new_dentry->d_name.len, src->i_ino,
+			       OUICHEFS_DT(src->i_mode));
+	if (ret)
+		return ret;
 
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		/* if old_dir == new_dir, save the renamed file position */
-		if (new_dir == old_dir) {
-			if (strncmp(dir_block->files[i].filename,
-				    old_dentry->d_name.name,
-				    OUICHEFS_FILENAME_LEN) == 0)
-				f_pos = i;
-		}
-		if (strncmp(dir_block->files[i].filename,
-			    new_dentry->d_name.name,
-			    OUICHEFS_FILENAME_LEN) == 0) {
-			ret = -EEXIST;
-			goto relse_new;
-		}
-		if (new_pos < 0 && dir_block->files[i].inode == 0)
-			new_pos = i;
-	}
-	/* if old_dir == new_dir, just rename entry */
-	if (old_dir == new_dir) {
-		strncpy(dir_block->files[f_pos].filename,
-			new_dentry->d_name.name,
-			OUICHEFS_FILENAME_LEN);
-		mark_buffer_dirty(bh_new);
-		ret = 0;
-		goto relse_new;
-	}
-
-
-	/* If new directory is empty, fail */
-	if (new_pos < 0) {
-		ret = -EMLINK;
-		goto relse_new;
+	/* remove target from old parent directory */
+	ret = ouichefs_dir_del(old_dir, old_dentry->d_name.name,
+			       old_dentry->d_name.len, src->i_ino);
+	if (ret) {
+		ouichefs_dir_del(new_dir, new_dentry->d_name.name,
+				 new_dentry->d_name.len, src->i_ino);
+		return ret;
 	}
 
-
-
-
-
-	/* insert in new parent directory */
-	dir_block->files[new_pos].inode = src->i_ino;
-	strncpy(dir_block->files[new_pos].filename,
-		new_dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh_new);
-	brelse(bh_new);
+	/* if old_dir == new_dir, the entry is just renamed */
+	if (old_dir == new_dir)
+		return 0;
 
 	/* Update new parent inode metadata */
 	new_dir->i_atime = new_dir->i_ctime
@@ -672,29 +1437,16 @@ static int ouichefs_rename(struct inode *old_dir, struct dentry *old_dentry,
 		inode_inc_link_count(new_dir);
 	mark_inode_dirty(new_dir);
 
-	/* remove target from old parent directory */
-	bh_old = sb_bread(sb, ci_old->index_block);
-	if (!bh_old)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_old->b_data;
-	/* Search for inode in old directory and number of subfiles */
-	for (i = 0; OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == src->i_ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
+	/* Move src's subtree summary from old_dir to new_dir */
+	sum_blocks = src->i_blocks;
+	sum_files = 1;
+	if (S_ISDIR(src->i_mode)) {
+		sum_blocks += OUICHEFS_INODE(src)->summary.nr_blocks;
+		sum_files = OUICHEFS_INODE(src)->summary.nr_files;
 	}
-	nr_subs = i;
-
-	/* Remove file from old parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id,
-			dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1],
-	       0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh_old);
-	brelse(bh_old);
+	ouichefs_summary_update(new_dir, src, sum_blocks, sum_files);
+	ouichefs_summary_update(old_dir, NULL, -sum_blocks, -sum_files);
+	ouichefs_ttl_queue(new_dir, src);
 
 	/* Update old parent inode metadata */
 	old_dir->i_atime = old_dir->i_ctime
@@ -705,10 +1457,6 @@ static int ouichefs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	mark_inode_dirty(old_dir);
 
 	return 0;
-
-relse_new:
-	brelse(bh_new);
-	return ret;
 }
 
 static int ouichefs_mkdir(struct inode *dir, struct dentry *dentry,
@@ -719,29 +1467,52 @@ static int ouichefs_mkdir(struct inode *dir, struct dentry *dentry,
 
 static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 {
-	struct super_block *sb = dir->i_sb;
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh;
-	struct ouichefs_dir_block *dblock;
+	int nr_files;
 
 
 	/* If the directory is not empty, fail */
 	if (inode->i_nlink > 2)
 		return -ENOTEMPTY;
-	bh = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-	if (dblock->files[0].inode != 0) {
-		brelse(bh);
+	nr_files = ouichefs_dir_nr_files(inode);
+	if (nr_files < 0)
+		return nr_files;
+	if (nr_files)
 		return -ENOTEMPTY;
-	}
-	brelse(bh);
 
 	/* Remove directory with unlink */
 	return ouichefs_unlink(dir, dentry);
 }
 
+/*
+ * Change the attributes of a file. A new mtime is reported to the parent
+ * directories as it may move the oldest mtime of their subtree. Blocks
+ * pending for pages past a new size are freed.
+ */
+static int ouichefs_setattr(struct dentry *dentry, struct iattr *iattr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct dentry *parent;
+	int ret;
+
+	ret = simple_setattr(dentry, iattr);
+	if (ret)
+		return ret;
+
+	/* Free the pending blocks of the pages truncated */
+	if (S_ISREG(inode->i_mode) && (iattr->ia_valid & ATTR_SIZE))
+		ouichefs_file_commit(inode, false);
+
+	if (S_ISREG(inode->i_mode) && (iattr->ia_valid & ATTR_MTIME)) {
+		parent = dget_parent(dentry);
+		ouichefs_summary_update(d_inode(parent), inode, 0, 0);
+		ouichefs_ttl_queue(d_inode(parent), inode);
+		dput(parent);
+	}
+
+	return 0;
+}
+
 static const struct inode_operations ouichefs_inode_ops = {
 	.lookup = ouichefs_lookup,
 	.create = ouichefs_create,
@@ -749,4 +1520,5 @@ static const struct inode_operations ouichefs_inode_ops = {
 	.mkdir  = ouichefs_mkdir,
 	.rmdir  = ouichefs_rmdir,
 	.rename = ouichefs_rename,
+	.setattr = ouichefs_setattr,
 };
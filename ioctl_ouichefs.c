@@ -3,14 +3,298 @@
 #include <fcntl.h>
 #include<sys/ioctl.h>
 #include <string.h>
+#include <unistd.h>
 #include "ioctl_ouichefs.h"
 char buff[100] = "coca";
 
 
+/* Print the access counters of a file */
+static int print_heat(const char *path)
+{
+	struct ouichefs_heat heat;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || ioctl(fd, GET_HEAT, &heat) < 0) {
+		perror(path);
+		return 1;
+	}
+	printf("%s: read=%u write=%u stamp=%u\n",
+	       path, heat.read, heat.write, heat.stamp);
+	return 0;
+}
+
+/* Set the budget of a directory if given, then print it */
+static int budget(int argc, char **argv)
+{
+	__u32 blocks;
+	int fd = open(argv[2], O_RDONLY);
+
+	if (fd < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	if (argc > 3) {
+		blocks = strtoul(argv[3], NULL, 10);
+		if (ioctl(fd, SET_BUDGET, &blocks) < 0) {
+			perror("SET_BUDGET");
+			return 1;
+		}
+	}
+	if (ioctl(fd, GET_BUDGET, &blocks) < 0) {
+		perror("GET_BUDGET");
+		return 1;
+	}
+	printf("%s: budget=%u blocks\n", argv[2], blocks);
+	return 0;
+}
+
+/* Set the TTL of a file or directory if given, then print it */
+static int ttl(int argc, char **argv)
+{
+	__u32 seconds;
+	int fd = open(argv[2], O_RDONLY);
+
+	if (fd < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	if (argc > 3) {
+		seconds = strtoul(argv[3], NULL, 10);
+		if (ioctl(fd, SET_TTL, &seconds) < 0) {
+			perror("SET_TTL");
+			return 1;
+		}
+	}
+	if (ioctl(fd, GET_TTL, &seconds) < 0) {
+		perror("GET_TTL");
+		return 1;
+	}
+	printf("%s: ttl=%us\n", argv[2], seconds);
+	return 0;
+}
+
+/* Pin or unpin a file if asked, then print its state */
+static int pin(int argc, char **argv)
+{
+	__u32 pinned;
+	int fd = open(argv[2], O_RDONLY);
+
+	if (fd < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	if (argc > 3) {
+		pinned = strtoul(argv[3], NULL, 10);
+		if (ioctl(fd, SET_PIN, &pinned) < 0) {
+			perror("SET_PIN");
+			return 1;
+		}
+	}
+	if (ioctl(fd, GET_PIN, &pinned) < 0) {
+		perror("GET_PIN");
+		return 1;
+	}
+	printf("%s: %s\n", argv[2], pinned ? "pinned" : "not pinned");
+	return 0;
+}
+
+/* Print the files that eviction would remove from a directory, best first */
+static int dry_run(int argc, char **argv)
+{
+	struct ouichefs_candidate c[OUICHEFS_DRY_RUN_MAX];
+	struct ouichefs_dry_run req;
+	int fd = open(argv[2], O_RDONLY);
+	unsigned int i;
+
+	if (fd < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	req.nr = argc > 3 ? strtoul(argv[3], NULL, 10) : 10;
+	if (req.nr > OUICHEFS_DRY_RUN_MAX)
+		req.nr = OUICHEFS_DRY_RUN_MAX;
+	req.candidates = (__u64)(unsigned long)c;
+	if (ioctl(fd, DRY_RUN, &req) < 0) {
+		perror("DRY_RUN");
+		return 1;
+	}
+	for (i = 0; i < req.nr; i++)
+		printf("%u: ino=%u parent=%u size=%u blocks=%u mtime=%u atime=%u score=%lld\n",
+		       i, c[i].ino, c[i].parent, c[i].size, c[i].blocks,
+		       c[i].mtime, c[i].atime, (long long)c[i].score);
+	return 0;
+}
+
+/* List a directory with the attributes of its files */
+static int readdir_plus(const char *path)
+{
+	static struct ouichefs_dirent_plus e[OUICHEFS_READDIR_PLUS_MAX];
+	struct ouichefs_readdir_plus req = { 0 };
+	int fd = open(path, O_RDONLY | O_DIRECTORY);
+	unsigned int i;
+
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	do {
+		req.nr = OUICHEFS_READDIR_PLUS_MAX;
+		req.entries = (__u64)(unsigned long)e;
+		if (ioctl(fd, READDIR_PLUS, &req) < 0) {
+			perror("READDIR_PLUS");
+			return 1;
+		}
+		for (i = 0; i < req.nr; i++)
+			printf("%u %o %u %u %u %u %u %u %s\n",
+			       e[i].ino, e[i].mode, e[i].nlink, e[i].uid,
+			       e[i].gid, e[i].size, e[i].blocks, e[i].mtime,
+			       e[i].name);
+	} while (!req.eof);
+	return 0;
+}
+
+/*
+ * Create (+name) and unlink (-name) files in a directory, in a single call,
+ * then print the result of each operation
+ */
+static int batch(int argc, char **argv)
+{
+	static struct ouichefs_batch_op ops[OUICHEFS_BATCH_MAX];
+	struct ouichefs_batch req = { 0 };
+	int fd = open(argv[2], O_RDONLY | O_DIRECTORY);
+	int i;
+
+	if (fd < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	for (i = 3; i < argc && req.nr < OUICHEFS_BATCH_MAX; i++) {
+		struct ouichefs_batch_op *op = &ops[req.nr++];
+
+		op->op = argv[i][0] == '-' ? OUICHEFS_BATCH_UNLINK :
+			 OUICHEFS_BATCH_CREATE;
+		op->mode = 0644;
+		if (argv[i][0] == '-' || argv[i][0] == '+')
+			argv[i]++;
+		strncpy(op->name, argv[i], sizeof(op->name) - 1);
+		op->name_len = strlen(op->name);
+	}
+	req.ops = (__u64)(unsigned long)ops;
+	if (ioctl(fd, BATCH, &req) < 0) {
+		perror("BATCH");
+		return 1;
+	}
+	for (i = 0; i < (int)req.nr; i++)
+		printf("%s %s: %s\n",
+		       ops[i].op == OUICHEFS_BATCH_UNLINK ? "unlink" : "create",
+		       ops[i].name, strerror(-ops[i].result));
+	return 0;
+}
+
+/* Remove a subdirectory and all its content */
+static int rmtree(const char *path, const char *name)
+{
+	struct ouichefs_rmtree req = { 0 };
+	int fd = open(path, O_RDONLY | O_DIRECTORY);
+
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	strncpy(req.name, name, sizeof(req.name) - 1);
+	req.name_len = strlen(req.name);
+	if (ioctl(fd, RMTREE, &req) < 0) {
+		perror("RMTREE");
+		return 1;
+	}
+	return 0;
+}
+
+/* Print the removal events as they come */
+static int events(int fd)
+{
+	struct ouichefs_event ev[16];
+	ssize_t n;
+	int i;
+
+	while ((n = read(fd, ev, sizeof(ev))) > 0) {
+		for (i = 0; i < n / (ssize_t)sizeof(ev[0]); i++) {
+			if (ev[i].reason == OUICHEFS_EVENT_LOST) {
+				printf("lost %u events\n", ev[i].lost);
+				continue;
+			}
+			printf("%s ino=%u parent=%u size=%u age=%us score=%lld latency=%lluns\n",
+			       ev[i].reason == OUICHEFS_EVENT_EXPIRE ? "expire" :
+			       ev[i].reason == OUICHEFS_EVENT_DEMOTE ? "demote" :
+			       "evict",
+			       ev[i].ino, ev[i].parent, ev[i].size, ev[i].age,
+			       (long long)ev[i].score,
+			       (unsigned long long)ev[i].latency_ns);
+		}
+		fflush(stdout);
+	}
+	perror("read");
+	return 1;
+}
+
+/* Set the eviction policy weights, or print them if none are given */
+static int policy(int fd, int argc, char **argv)
+{
+	struct ouichefs_policy p;
+
+	if (argc == 6) {
+		p.w_size = atoi(argv[2]);
+		p.w_age = atoi(argv[3]);
+		p.w_atime = atoi(argv[4]);
+		p.w_heat = atoi(argv[5]);
+		if (ioctl(fd, SET_POLICY, &p) < 0) {
+			perror("SET_POLICY");
+			return 1;
+		}
+	}
+	if (ioctl(fd, GET_POLICY, &p) < 0) {
+		perror("GET_POLICY");
+		return 1;
+	}
+	printf("size=%d age=%d atime=%d heat=%d\n",
+	       p.w_size, p.w_age, p.w_atime, p.w_heat);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
-	int fd = open("/dev/ouichefs", O_WRONLY);
+	int fd;
+
+	if (argc > 2 && !strcmp(argv[1], "heat"))
+		return print_heat(argv[2]);
+	if (argc > 2 && !strcmp(argv[1], "budget"))
+		return budget(argc, argv);
+	if (argc > 2 && !strcmp(argv[1], "ttl"))
+		return ttl(argc, argv);
+	if (argc > 2 && !strcmp(argv[1], "pin"))
+		return pin(argc, argv);
+	if (argc > 2 && !strcmp(argv[1], "dry-run"))
+		return dry_run(argc, argv);
+	if (argc > 2 && !strcmp(argv[1], "ls"))
+		return readdir_plus(argv[2]);
+	if (argc > 2 && !strcmp(argv[1], "batch"))
+		return batch(argc, argv);
+	if (argc > 3 && !strcmp(argv[1], "rmtree"))
+		return rmtree(argv[2], argv[3]);
+
+	if (argc > 1 && !strcmp(argv[1], "events")) {
+		fd = open("/dev/ouichefs", O_RDONLY);
+		return events(fd);
+	}
+
+	fd = open("/dev/ouichefs", O_WRONLY);
+
+	if (argc > 1 && !strcmp(argv[1], "policy"))
+		return policy(fd, argc, argv);
 	
-	ioctl(fd, QUICK_CLEAN);
+	if (ioctl(fd, QUICK_CLEAN) < 0) {
+		perror("QUICK_CLEAN");
+		return 1;
+	}
 	return 0;
 }
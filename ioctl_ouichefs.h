@@ -1,8 +1,178 @@
 #ifndef _IOCTL_OUICHEFS
 #define _IOCTL_OUICHEFS
 
+#include <linux/types.h>
+
 #define IOC_MAGIC 'N'
+/* On /dev/ouichefs: free blocks now (CAP_SYS_ADMIN) */
 #define QUICK_CLEAN _IO(IOC_MAGIC, 20)
 
+/* Decayed access counters of a file, see GET_HEAT */
+struct ouichefs_heat {
+	__u32 read;
+	__u32 write;
+	__u32 stamp;	/* Time of the last decay of the counters */
+};
+
+/* On a file: read its access counters */
+#define GET_HEAT _IOR(IOC_MAGIC, 21, struct ouichefs_heat)
+
+/*
+ * Eviction scoring policy: the file with the highest score is evicted.
+ * score = w_size * size in KiB + w_age * hours since last modification
+ *       + w_atime * hours since last access + w_heat * access count
+ * All weights set to 0 restores the default mtime strategy. Weights must be
+ * between -OUICHEFS_POLICY_WEIGHT_MAX and OUICHEFS_POLICY_WEIGHT_MAX. A
+ * negative weight keeps the files with a large value: a negative w_heat
+ * evicts cold files first.
+ */
+#define OUICHEFS_POLICY_WEIGHT_MAX (1 << 16)
+
+struct ouichefs_policy {
+	__s32 w_size;
+	__s32 w_age;
+	__s32 w_atime;
+	__s32 w_heat;
+};
+
+/* On /dev/ouichefs: set (CAP_SYS_ADMIN) or read the eviction scoring policy */
+#define SET_POLICY _IOW(IOC_MAGIC, 22, struct ouichefs_policy)
+#define GET_POLICY _IOR(IOC_MAGIC, 23, struct ouichefs_policy)
+
+/*
+ * On a directory: set or read its space budget, in blocks. When the
+ * subtree would go over its budget, files are evicted from this subtree
+ * only. 0 means no budget.
+ */
+#define SET_BUDGET _IOW(IOC_MAGIC, 24, __u32)
+#define GET_BUDGET _IOR(IOC_MAGIC, 25, __u32)
+
+/*
+ * On a file: set or read its TTL, in seconds after its last modification.
+ * Expired files are unlinked in the background. On a directory: TTL given
+ * to the files created in it. 0 means no TTL.
+ */
+#define SET_TTL _IOW(IOC_MAGIC, 26, __u32)
+#define GET_TTL _IOR(IOC_MAGIC, 27, __u32)
+
+/* On a file: pin (1) or unpin (0) it, a pinned file is never evicted */
+#define SET_PIN _IOW(IOC_MAGIC, 28, __u32)
+#define GET_PIN _IOR(IOC_MAGIC, 29, __u32)
+
+/* A file that would be evicted, see DRY_RUN */
+struct ouichefs_candidate {
+	__u32 ino;
+	__u32 parent;		/* Directory containing it */
+	__u32 size;		/* Size in bytes */
+	__u32 blocks;		/* Blocks freed by its eviction */
+	__u32 mtime;
+	__u32 atime;
+	__s64 score;		/* Score with SET_POLICY weights, 0 otherwise */
+};
+
+/* Maximum number of candidates returned by DRY_RUN */
+#define OUICHEFS_DRY_RUN_MAX	256
+
+struct ouichefs_dry_run {
+	__u32 nr;		/* In: size of candidates, out: number filled */
+	__u32 pad;
+	__u64 candidates;	/* Pointer to an array of nr candidates */
+};
+
+/*
+ * On a directory: rank the files of its subtree with the active eviction
+ * strategy, best victim first, without removing anything (CAP_SYS_ADMIN).
+ */
+#define DRY_RUN _IOWR(IOC_MAGIC, 30, struct ouichefs_dry_run)
+
+/* A directory entry and the attributes of its file, see READDIR_PLUS */
+struct ouichefs_dirent_plus {
+	__u32 ino;
+	__u32 mode;
+	__u32 uid;
+	__u32 gid;
+	__u32 nlink;
+	__u32 size;		/* Size in bytes */
+	__u32 blocks;
+	__u32 atime;
+	__u32 mtime;
+	__u32 ctime;
+	__u32 name_len;
+	char name[256];		/* Null terminated */
+};
+
+/* Maximum number of entries returned by READDIR_PLUS */
+#define OUICHEFS_READDIR_PLUS_MAX	256
+
+struct ouichefs_readdir_plus {
+	__u64 cookie;		/* In: 0 or previous out value, out: next */
+	__u64 entries;		/* Pointer to an array of nr entries */
+	__u32 nr;		/* In: size of entries, out: number filled */
+	__u32 eof;		/* Out: 1 if the whole directory was read */
+};
+
+/*
+ * On a directory: read its entries with the attributes of their files in a
+ * single call. Call again with the returned cookie until eof is set.
+ */
+#define READDIR_PLUS _IOWR(IOC_MAGIC, 31, struct ouichefs_readdir_plus)
+
+/* Operations of BATCH */
+#define OUICHEFS_BATCH_CREATE	0	/* Create a regular file */
+#define OUICHEFS_BATCH_UNLINK	1	/* Unlink a regular file */
+
+struct ouichefs_batch_op {
+	__u32 op;		/* OUICHEFS_BATCH_* */
+	__u32 mode;		/* Create: permissions of the file */
+	__s32 result;		/* Out: 0 or -errno */
+	__u32 name_len;
+	char name[256];
+};
+
+/* Maximum number of operations of a BATCH call */
+#define OUICHEFS_BATCH_MAX	256
+
+struct ouichefs_batch {
+	__u32 nr;		/* Number of operations */
+	__u32 pad;
+	__u64 ops;		/* Pointer to an array of nr operations */
+};
+
+/*
+ * On a directory: create or unlink files in it, in order, holding the
+ * directory lock once for the whole batch. Each operation gets its result.
+ */
+#define BATCH _IOWR(IOC_MAGIC, 32, struct ouichefs_batch)
+
+struct ouichefs_rmtree {
+	__u32 name_len;
+	char name[256];
+};
+
+/*
+ * On a directory: remove its subdirectory name with all its content
+ * (CAP_SYS_ADMIN). The subdirectory disappears at once, its files are freed
+ * in the background.
+ */
+#define RMTREE _IOW(IOC_MAGIC, 33, struct ouichefs_rmtree)
+
+/* Why a file was removed by ouichefs, see struct ouichefs_event */
+#define OUICHEFS_EVENT_EVICT	0	/* Chosen by the eviction strategy */
+#define OUICHEFS_EVENT_EXPIRE	1	/* TTL elapsed */
+#define OUICHEFS_EVENT_DEMOTE	2	/* Moved to the cold tier */
+#define OUICHEFS_EVENT_LOST	3	/* Events dropped, only lost is set */
+
+/* Removal event, read() from /dev/ouichefs returns an array of these */
+struct ouichefs_event {
+	__u32 reason;		/* OUICHEFS_EVENT_* */
+	__u32 ino;		/* Removed file */
+	__u32 parent;		/* Directory that contained it */
+	__u32 size;		/* Size in bytes */
+	__u32 age;		/* Seconds since its last modification */
+	__u32 lost;		/* Events dropped since the last read */
+	__s64 score;		/* Score with SET_POLICY weights, 0 otherwise */
+	__u64 latency_ns;	/* Time spent choosing and removing it */
+};
+
 
 #endif
\ No newline at end of file
@@ -10,13 +10,13 @@
 #include <string.h>
 
 #define OUICHEFS_MAGIC  0x48434957
+#define OUICHEFS_VERSION         2
 
 #define OUICHEFS_SB_BLOCK_NR     0
 
 #define OUICHEFS_BLOCK_SIZE       (1 << 12)  /* 4 KiB */
 #define OUICHEFS_MAX_FILESIZE     (1 << 22)  /* 4 MiB */
-#define OUICHEFS_FILENAME_LEN            28
-#define OUICHEFS_MAX_SUBFILES           128
+#define OUICHEFS_FILENAME_LEN           255
 
 
 struct ouichefs_inode {
@@ -30,6 +30,18 @@ struct ouichefs_inode {
 	uint32_t i_blocks;	  /* Block count (subdir count for directories) */
 	uint32_t i_nlink;	  /* Hard links count */
 	uint32_t index_block;	  /* Block with list of blocks for this file */
+	uint32_t i_sum_mtime;	  /* Subtree: oldest file mtime (lower bound) */
+	uint32_t i_sum_size;	  /* Subtree: largest file size (upper bound) */
+	uint32_t i_sum_blocks;	  /* Subtree: total block count */
+	uint32_t i_sum_files;	  /* Subtree: number of regular files */
+	uint32_t i_heat_read;	  /* Decayed read counter */
+	uint32_t i_heat_write;	  /* Decayed write counter */
+	uint32_t i_heat_stamp;	  /* Last decay of the counters */
+	uint32_t i_budget;	  /* Directory: max subtree blocks (0: none) */
+	uint32_t i_ttl;		  /* Lifetime in seconds after mtime (0: none) */
+	uint32_t i_flags;	  /* Inode flags */
+	uint32_t i_orphan;	  /* Next inode in the orphan list */
+	uint32_t i_cold_slot;	  /* Slot of the cold tier holding the data */
 };
 
 #define OUICHEFS_INODES_PER_BLOCK (OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
@@ -47,18 +59,22 @@ struct ouichefs_superblock {
 	uint32_t nr_free_inodes;  /* Number of free inodes */
 	uint32_t nr_free_blocks;  /* Number of free blocks */
 
-	char padding[4064];       /* Padding to match block size */
+	uint32_t orphan_head;	  /* First inode of the orphan list */
+	uint32_t version;	  /* On-disk format version */
+
+	char padding[4056];       /* Padding to match block size */
 };
 
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
 
-struct ouichefs_dir_block {
-	struct ouichefs_file {
-		uint32_t inode;
-		char filename[OUICHEFS_FILENAME_LEN];
-	} files[OUICHEFS_MAX_SUBFILES];
+struct ouichefs_dirent {
+	uint32_t inode;
+	uint16_t rec_len;	/* Length of this entry */
+	uint8_t name_len;
+	uint8_t file_type;	/* DT_* type of the file */
+	char name[];		/* Not null terminated */
 };
 
 static inline void usage(char *appname)
@@ -109,6 +125,7 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
 	sb->nr_free_inodes = htole32(nr_inodes - 1);
 	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
+	sb->version = htole32(OUICHEFS_VERSION);
 
 	ret = write(fd, sb, sizeof(struct ouichefs_superblock));
 	if (ret != sizeof(struct ouichefs_superblock)) {
@@ -123,11 +140,12 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
+	       "\tnr_free_blocks=%u\n"
+	       "\tversion=%u\n",
 	       sizeof(struct ouichefs_superblock),
 	       sb->magic, sb->nr_blocks, sb->nr_inodes, sb->nr_istore_blocks,
 	       sb->nr_ifree_blocks, sb->nr_bfree_blocks, sb->nr_free_inodes,
-	       sb->nr_free_blocks);
+	       sb->nr_free_blocks, sb->version);
 
 	return sb;
 }
@@ -162,6 +180,13 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	inode->i_blocks = htole32(1);
 	inode->i_nlink = htole32(2);
 	inode->index_block = htole32(first_data_block);
+	inode->i_sum_mtime = inode->i_sum_size = htole32(0);
+	inode->i_sum_blocks = inode->i_sum_files = htole32(0);
+	inode->i_heat_read = inode->i_heat_write = htole32(0);
+	inode->i_heat_stamp = htole32(0);
+	inode->i_budget = htole32(0);
+	inode->i_ttl = htole32(0);
+	inode->i_flags = htole32(0);
 
 	ret = write(fd, block, OUICHEFS_BLOCK_SIZE);
 	if (ret != OUICHEFS_BLOCK_SIZE) {
@@ -290,7 +315,7 @@ end:
 static int write_data_blocks(int fd, struct ouichefs_superblock *sb)
 {
 	int ret = 0;
-	/* struct ouichefs_dir_block root_block; */
+	/* struct ouichefs_dirent root_block; */
 	/* struct ouichefs_file_index_block foo_block; */
 	/* char *foo; */
 	/* uint32_t first_block = le32toh(sb->nr_istore_blocks) + */
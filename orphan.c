@@ -0,0 +1,503 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Unlinked inodes are not freed by unlink: they are chained in an on-disk
+ * orphan list (head in the superblock, next in i_orphan of each inode) and
+ * their blocks are freed in the background once the last reference to them
+ * is dropped. The orphan list is processed again at mount, so that a crash
+ * does not leak the blocks of the files unlinked before it.
+ */
+
+/* An inode of the orphan list */
+struct ouichefs_orphan {
+	struct list_head list;	/* In the same order as the on-disk list */
+	uint32_t ino;
+	uint32_t index_block;
+	uint32_t nr_blocks;
+	uint32_t flags;
+	bool is_dir;
+	bool released;		/* No more references, blocks can be freed */
+};
+
+/* Orphan list of a partition and its worker */
+struct ouichefs_orphans {
+	struct super_block *sb;
+	struct mutex lock;
+	struct list_head list;
+	struct work_struct work;
+};
+
+static struct ouichefs_inode *orphan_read(struct super_block *sb, uint32_t ino,
+					  struct buffer_head **bh)
+{
+	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
+	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+
+	*bh = sb_bread(sb, inode_block);
+	if (!*bh)
+		return NULL;
+	return (struct ouichefs_inode *)(*bh)->b_data + inode_shift;
+}
+
+/*
+ * Set the next orphan of ino on disk. This field is never written from the
+ * in-memory inode, so it does not need to be in ouichefs_inode_info.
+ */
+static int orphan_link(struct super_block *sb, uint32_t ino, uint32_t next)
+{
+	struct ouichefs_inode *cinode;
+	struct buffer_head *bh;
+
+	cinode = orphan_read(sb, ino, &bh);
+	if (!cinode)
+		return -EIO;
+	cinode->i_orphan = next;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+/*
+ * Add inode at the head of the orphan list. Must be called before the last
+ * link of inode is removed.
+ */
+int ouichefs_orphan_add(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_orphans *orphans = sbi->orphans;
+	struct ouichefs_orphan *o;
+	int ret;
+
+	o = kzalloc(sizeof(*o), GFP_KERNEL);
+	if (!o)
+		return -ENOMEM;
+	o->ino = inode->i_ino;
+
+	mutex_lock(&orphans->lock);
+	ret = orphan_link(sb, inode->i_ino, sbi->orphan_head);
+	if (ret) {
+		mutex_unlock(&orphans->lock);
+		kfree(o);
+		return ret;
+	}
+	sbi->orphan_head = inode->i_ino;
+	list_add(&o->list, &orphans->list);
+	mutex_unlock(&orphans->lock);
+
+	return 0;
+}
+
+/*
+ * Called when the last reference to inode is dropped: queue its blocks to be
+ * freed if it is an orphan.
+ */
+void ouichefs_orphan_release(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_orphans *orphans = sbi->orphans;
+	struct ouichefs_orphan *o;
+	bool found = false;
+
+	mutex_lock(&orphans->lock);
+	list_for_each_entry(o, &orphans->list, list) {
+		if (o->ino != inode->i_ino)
+			continue;
+		o->index_block = OUICHEFS_INODE(inode)->index_block;
+		o->nr_blocks = inode->i_blocks;
+		o->flags = OUICHEFS_INODE(inode)->flags;
+		o->is_dir = S_ISDIR(inode->i_mode);
+		o->released = true;
+		found = true;
+		break;
+	}
+	mutex_unlock(&orphans->lock);
+
+	if (found)
+		queue_work(system_unbound_wq, &orphans->work);
+}
+
+/*
+ * Discard the nr blocks starting at start if the partition is mounted with
+ * the discard option.
+ */
+static void orphan_discard(struct super_block *sb, uint32_t start,
+			   uint32_t nr)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (nr && sbi->discard)
+		sb_issue_discard(sb, start, nr, GFP_NOFS, 0);
+}
+
+/*
+ * Clear the index block of orphan ino on disk, and wait for it to be written,
+ * before its blocks are freed and maybe reused. Otherwise, after a crash, the
+ * orphan list processing at mount would free the blocks of another file, or
+ * read them as the entries of an orphan directory. A crash before the bitmap
+ * is written back only leaks the blocks.
+ */
+static int orphan_forget_blocks(struct super_block *sb, uint32_t ino)
+{
+	struct ouichefs_inode *cinode;
+	struct buffer_head *bh;
+	int ret;
+
+	cinode = orphan_read(sb, ino, &bh);
+	if (!cinode)
+		return -EIO;
+	cinode->index_block = 0;
+	mark_buffer_dirty(bh);
+	ret = sync_dirty_buffer(bh);
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Free the blocks of an orphan. They are not scrubbed: a freed block is
+ * either fully rewritten (index and directory blocks) or flagged as new
+ * when it is allocated again to a file, so that its old content is never
+ * read, and only enters the index of the file once its new data is on disk
+ * (see ouichefs_file_commit()). If we fail to read the index block, lose this
+ * file's blocks forever.
+ */
+static void orphan_free_blocks(struct super_block *sb,
+			       struct ouichefs_orphan *o)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_file_index_block *file_block;
+	struct buffer_head *bh;
+	uint32_t start = 0, nr = 0;
+	int i;
+
+	if (!o->index_block)
+		return;
+
+	bh = sb_bread(sb, o->index_block);
+	if (!bh)
+		return;
+	file_block = (struct ouichefs_file_index_block *)bh->b_data;
+
+	for (i = 0; !o->is_dir && i < (int)o->nr_blocks - 1; i++) {
+		uint32_t bno = file_block->blocks[i];
+
+		if (!bno)
+			continue;
+		put_block(sbi, bno);
+		/* Discard contiguous blocks together */
+		if (nr && bno == start + nr) {
+			nr++;
+			continue;
+		}
+		orphan_discard(sb, start, nr);
+		start = bno;
+		nr = 1;
+	}
+	orphan_discard(sb, start, nr);
+
+	/* The leaves of a hashed directory are listed in its index block */
+	if (o->is_dir)
+		ouichefs_dir_free_leaves(sb, o->index_block, o->flags);
+
+	/* The index block will not be written back anymore */
+	bforget(bh);
+	put_block(sbi, o->index_block);
+	orphan_discard(sb, o->index_block, 1);
+}
+
+/*
+ * Remove o from the orphan list, on disk and in memory. Must be called with
+ * orphans->lock held.
+ */
+static void orphan_del(struct ouichefs_orphans *orphans,
+		       struct ouichefs_orphan *o)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(orphans->sb);
+	uint32_t next = 0;
+
+	if (!list_is_last(&o->list, &orphans->list))
+		next = list_next_entry(o, list)->ino;
+	if (o->list.prev == &orphans->list)
+		sbi->orphan_head = next;
+	else if (orphan_link(orphans->sb, list_prev_entry(o, list)->ino, next))
+		pr_err("orphan list broken at inode %u\n",
+		       list_prev_entry(o, list)->ino);
+	list_del(&o->list);
+}
+
+/*
+ * Remove inode from the orphan list, when its last link could not be removed
+ * after ouichefs_orphan_add().
+ */
+void ouichefs_orphan_cancel(struct inode *inode)
+{
+	struct ouichefs_orphans *orphans = OUICHEFS_SB(inode->i_sb)->orphans;
+	struct ouichefs_orphan *o;
+
+	mutex_lock(&orphans->lock);
+	list_for_each_entry(o, &orphans->list, list) {
+		if (o->ino != inode->i_ino || o->released)
+			continue;
+		orphan_del(orphans, o);
+		kfree(o);
+		break;
+	}
+	mutex_unlock(&orphans->lock);
+}
+
+/*
+ * Free the released orphans: their blocks first, then their inode, once it is
+ * out of the orphan list.
+ */
+static void ouichefs_orphan_work(struct work_struct *work)
+{
+	struct ouichefs_orphans *orphans =
+		container_of(work, struct ouichefs_orphans, work);
+	struct super_block *sb = orphans->sb;
+	struct ouichefs_orphan *o;
+	struct ouichefs_inode *cinode;
+	struct buffer_head *bh;
+
+	for (;;) {
+		/* The orphans stay on disk, they are freed at next mount */
+		if (sb_rdonly(sb))
+			return;
+
+		mutex_lock(&orphans->lock);
+		list_for_each_entry(o, &orphans->list, list)
+			if (o->released)
+				goto found;
+		mutex_unlock(&orphans->lock);
+		return;
+found:
+		mutex_unlock(&orphans->lock);
+
+		/* o cannot go away: only this worker removes released orphans */
+		if (o->index_block && orphan_forget_blocks(sb, o->ino))
+			pr_err("cannot free the blocks of inode %u\n", o->ino);
+		else
+			orphan_free_blocks(sb, o);
+
+		mutex_lock(&orphans->lock);
+		orphan_del(orphans, o);
+		mutex_unlock(&orphans->lock);
+
+		/* Cleanup inode, then free it */
+		cinode = orphan_read(sb, o->ino, &bh);
+		if (cinode) {
+			memset(cinode, 0, sizeof(*cinode));
+			mark_buffer_dirty(bh);
+			brelse(bh);
+		}
+		put_inode(OUICHEFS_SB(sb), o->ino);
+		kfree(o);
+		cond_resched();
+	}
+}
+
+/* State of the adoption of the files of orphan directories at mount */
+struct ouichefs_adopt {
+	struct super_block *sb;
+	struct ouichefs_orphans *orphans;
+	unsigned long *listed;	/* Inodes already in the orphan list */
+	int ret;
+};
+
+/*
+ * Add the file ino, still listed in an orphan directory, at the tail of the
+ * orphan list.
+ */
+static int orphan_adopt_actor(void *data, const char *name, unsigned int len,
+			      uint32_t ino, unsigned int type)
+{
+	struct ouichefs_adopt *a = data;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(a->sb);
+	struct ouichefs_orphan *o, *tail;
+	struct ouichefs_inode *cinode;
+	struct buffer_head *bh;
+
+	if (ino >= sbi->nr_inodes || test_and_set_bit(ino, a->listed))
+		return 0;
+	o = kzalloc(sizeof(*o), GFP_KERNEL);
+	if (!o)
+		return -ENOMEM;
+	cinode = orphan_read(a->sb, ino, &bh);
+	if (!cinode) {
+		kfree(o);
+		return -EIO;
+	}
+	/* Already freed, the entry was not removed before the crash */
+	if (!cinode->i_mode) {
+		brelse(bh);
+		kfree(o);
+		return 0;
+	}
+	o->ino = ino;
+	o->index_block = cinode->index_block;
+	o->nr_blocks = cinode->i_blocks;
+	o->flags = cinode->i_flags;
+	o->is_dir = S_ISDIR(cinode->i_mode);
+	o->released = true;
+	cinode->i_nlink = 0;
+	cinode->i_orphan = 0;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	tail = list_last_entry(&a->orphans->list, struct ouichefs_orphan, list);
+	list_add_tail(&o->list, &a->orphans->list);
+	return orphan_link(a->sb, tail->ino, ino);
+}
+
+/*
+ * Chain the files still listed in the orphan directories in the orphan list,
+ * left there by a subtree deletion that did not complete (see rmtree.c). The
+ * subdirectories adopted are walked in turn, as they are added at the tail.
+ * Directories whose blocks were being freed have no index block on disk
+ * anymore (see orphan_forget_blocks()) and are not walked.
+ */
+static int orphan_adopt(struct super_block *sb, struct ouichefs_orphans *orphans)
+{
+	struct ouichefs_adopt a = { .sb = sb, .orphans = orphans };
+	struct ouichefs_orphan *o;
+	int ret = 0;
+
+	a.listed = kvcalloc(BITS_TO_LONGS(OUICHEFS_SB(sb)->nr_inodes),
+			    sizeof(long), GFP_KERNEL);
+	if (!a.listed)
+		return -ENOMEM;
+	list_for_each_entry(o, &orphans->list, list)
+		set_bit(o->ino, a.listed);
+
+	list_for_each_entry(o, &orphans->list, list) {
+		if (!o->is_dir || !o->index_block)
+			continue;
+		ret = ouichefs_dir_walk(sb, o->index_block, o->flags,
+					orphan_adopt_actor, &a);
+		if (ret)
+			break;
+	}
+	kvfree(a.listed);
+
+	return ret;
+}
+
+/*
+ * Load the orphan list of sb and start freeing it: no inode of the list is in
+ * use after a mount.
+ */
+int ouichefs_orphan_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_orphans *orphans;
+	struct ouichefs_orphan *o;
+	struct ouichefs_inode *cinode;
+	struct buffer_head *bh;
+	uint32_t ino, nr = 0;
+	int ret = -ENOMEM;
+
+	orphans = kzalloc(sizeof(*orphans), GFP_KERNEL);
+	if (!orphans)
+		return -ENOMEM;
+	orphans->sb = sb;
+	mutex_init(&orphans->lock);
+	INIT_LIST_HEAD(&orphans->list);
+	INIT_WORK(&orphans->work, ouichefs_orphan_work);
+	sbi->orphans = orphans;
+
+	for (ino = sbi->orphan_head; ino; nr++) {
+		/* Do not loop forever on a corrupted list */
+		if (ino >= sbi->nr_inodes || nr >= sbi->nr_inodes) {
+			pr_err("corrupted orphan list, inode %u\n", ino);
+			if (list_empty(&orphans->list))
+				sbi->orphan_head = 0;
+			else
+				orphan_link(sb, list_last_entry(&orphans->list,
+						struct ouichefs_orphan, list)->ino, 0);
+			break;
+		}
+		o = kzalloc(sizeof(*o), GFP_KERNEL);
+		if (!o)
+			goto err;
+		cinode = orphan_read(sb, ino, &bh);
+		if (!cinode) {
+			kfree(o);
+			ret = -EIO;
+			goto err;
+		}
+		o->ino = ino;
+		o->index_block = cinode->index_block;
+		o->nr_blocks = cinode->i_blocks;
+		o->flags = cinode->i_flags;
+		o->is_dir = S_ISDIR(cinode->i_mode);
+		o->released = true;
+		ino = cinode->i_orphan;
+		brelse(bh);
+		list_add_tail(&o->list, &orphans->list);
+	}
+
+	ret = orphan_adopt(sb, orphans);
+	if (ret)
+		goto err;
+
+	if (nr) {
+		pr_info("freeing %u orphan inodes\n", nr);
+		queue_work(system_unbound_wq, &orphans->work);
+	}
+
+	return 0;
+
+err:
+	ouichefs_orphan_destroy(sb);
+	return ret;
+}
+
+/*
+ * Wait for the blocks of the released orphans of sb to be freed, so that a
+ * caller that just removed a file sees them in the free block count.
+ */
+void ouichefs_orphan_flush(struct super_block *sb)
+{
+	flush_work(&OUICHEFS_SB(sb)->orphans->work);
+}
+
+/*
+ * Wait for the released orphans of sb to be freed, then forget the orphan
+ * list. Orphans still in use stay on disk and are freed at next mount.
+ */
+void ouichefs_orphan_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_orphans *orphans;
+	struct ouichefs_orphan *o, *tmp;
+
+	if (!sbi || !sbi->orphans)
+		return;
+	orphans = sbi->orphans;
+
+	flush_work(&orphans->work);
+	sbi->orphans = NULL;
+	list_for_each_entry_safe(o, tmp, &orphans->list, list)
+		kfree(o);
+	kfree(orphans);
+}
@@ -10,13 +10,13 @@
 #include <linux/fs.h>
 
 #define OUICHEFS_MAGIC  0x48434957
+#define OUICHEFS_VERSION         2  /* Bumped on every on-disk format change */
 
 #define OUICHEFS_SB_BLOCK_NR     0
 
 #define OUICHEFS_BLOCK_SIZE       (1 << 12)  /* 4 KiB */
 #define OUICHEFS_MAX_FILESIZE     (1 << 22)  /* 4 MiB */
-#define OUICHEFS_FILENAME_LEN            28
-#define OUICHEFS_MAX_SUBFILES           128
+#define OUICHEFS_FILENAME_LEN           255
 
 
 /*
@@ -48,13 +48,61 @@ struct ouichefs_inode {
 	uint32_t i_blocks;	/* Block count */
 	uint32_t i_nlink;	/* Hard links count */
 	uint32_t index_block;	/* Block with list of blocks for this file */
+	uint32_t i_sum_mtime;	/* Subtree: oldest file mtime (lower bound) */
+	uint32_t i_sum_size;	/* Subtree: largest file size (upper bound) */
+	uint32_t i_sum_blocks;	/* Subtree: total block count */
+	uint32_t i_sum_files;	/* Subtree: number of regular files */
+	uint32_t i_heat_read;	/* Decayed read counter */
+	uint32_t i_heat_write;	/* Decayed write counter */
+	uint32_t i_heat_stamp;	/* Last decay of the counters */
+	uint32_t i_budget;	/* Directory: max subtree blocks (0: none) */
+	uint32_t i_ttl;		/* Lifetime in seconds after mtime (0: none) */
+	uint32_t i_flags;	/* OUICHEFS_FL_* flags */
+	uint32_t i_orphan;	/* Next inode in the orphan list (0: last) */
+	uint32_t i_cold_slot;	/* Slot of the cold tier holding the data */
+};
+
+/* Inode flags */
+#define OUICHEFS_FL_PINNED	0x1	/* Never evicted nor expired */
+#define OUICHEFS_FL_COLD	0x2	/* Data moved to the cold tier */
+#define OUICHEFS_FL_HTREE	0x4	/* Directory: hashed, several leaves */
+
+/*
+ * Summary of the content of a directory subtree, used to prune the eviction
+ * search. oldest_mtime and largest_size are only bounds: they are tightened
+ * each time the eviction search walks the whole subtree.
+ */
+struct ouichefs_dir_summary {
+	uint32_t oldest_mtime;
+	uint32_t largest_size;
+	uint32_t nr_blocks;
+	uint32_t nr_files;
 };
 
 struct ouichefs_inode_info {
 	uint32_t index_block;
+	struct ouichefs_dir_summary summary; /* Only for directories */
+	uint32_t heat_read;
+	uint32_t heat_write;
+	uint32_t heat_stamp;
+	uint32_t budget;	/* Only for directories */
+	uint32_t ttl;		/* For directories: inherited by new files */
+	uint32_t flags;
+	uint32_t cold_slot;	/* Only with OUICHEFS_FL_COLD */
+	atomic_t nr_open;	/* Number of open files on this inode */
+	time64_t close_stamp;	/* Last time a file was closed */
+	struct ouichefs_dir_index *dir_index; /* Only for directories */
+	struct buffer_head *index_bh;	/* Index block of open files */
+	uint32_t *pending;	/* Blocks of files waiting for their data */
 	struct inode vfs_inode;
 };
 
+/* Access counters are halved every OUICHEFS_HEAT_HALFLIFE seconds */
+#define OUICHEFS_HEAT_HALFLIFE	      3600
+
+/* Files closed less than OUICHEFS_BUSY_GRACE seconds ago are not evicted */
+#define OUICHEFS_BUSY_GRACE		 5
+
 #define OUICHEFS_INODES_PER_BLOCK \
 	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
 
@@ -72,25 +120,72 @@ struct ouichefs_sb_info {
 	uint32_t nr_free_inodes;  /* Number of free inodes */
 	uint32_t nr_free_blocks;  /* Number of free blocks */
 
+	uint32_t orphan_head;	  /* First inode of the orphan list (0: none) */
+	uint32_t version;	  /* On-disk format version */
+
+	bool discard;		  /* Discard the freed blocks */
+
+	spinlock_t bitmap_lock;	     /* Protects the bitmaps and free counts */
 	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
 	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+
+	struct ouichefs_ttl *ttl; /* Expiry queue of files with a TTL */
+	struct file *cold;	  /* Cold tier for evicted files, or NULL */
+	unsigned long *cold_slots; /* Used slots of the cold tier */
+	struct ouichefs_orphans *orphans; /* Unlinked inodes not freed yet */
+	struct ouichefs_rmtree_queue *rmtree;	  /* Subtrees being deleted */
+
+	struct super_block *sb;
+	struct work_struct watermark_work; /* Eviction under the watermark */
+	bool watermark_off;	  /* Unmounting, no more background eviction */
 };
 
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
 
-struct ouichefs_dir_block {
-	struct ouichefs_file {
-		uint32_t inode;
-		char filename[OUICHEFS_FILENAME_LEN];
-	} files[OUICHEFS_MAX_SUBFILES];
+/*
+ * Entry of a directory block. Entries are packed at the start of the block,
+ * each one taking OUICHEFS_DIRENT_LEN(name_len) bytes. The first entry with a
+ * null rec_len ends the block, so a zeroed block is an empty directory.
+ */
+struct ouichefs_dirent {
+	uint32_t inode;
+	uint16_t rec_len;	/* Length of this entry */
+	uint8_t name_len;
+	uint8_t file_type;	/* DT_* type of the file */
+	char name[];		/* Not null terminated */
+};
+
+#define OUICHEFS_DIRENT_LEN(name_len) \
+	ALIGN(sizeof(struct ouichefs_dirent) + (name_len), 4)
+#define OUICHEFS_MAX_SUBFILES \
+	(OUICHEFS_BLOCK_SIZE / OUICHEFS_DIRENT_LEN(1))
+
+/* DT_* type of a file, from its mode */
+#define OUICHEFS_DT(mode)	(((mode) & S_IFMT) >> 12)
+
+/*
+ * Index block of a hashed directory (OUICHEFS_FL_HTREE). The low depth bits
+ * of the hash of a name select a bucket, holding the position in leaves of
+ * the block containing the name. A leaf is a block of struct ouichefs_dirent.
+ */
+#define OUICHEFS_DIR_BUCKETS		512
+#define OUICHEFS_DIR_MAX_LEAVES		509
+
+struct ouichefs_dir_htree {
+	uint32_t depth;		/* Number of buckets in use: 1 << depth */
+	uint32_t nr_leaves;
+	uint32_t nr_files;
+	uint32_t buckets[OUICHEFS_DIR_BUCKETS];
+	uint32_t leaves[OUICHEFS_DIR_MAX_LEAVES];
 };
 
 /* Structure ajoutée */
 struct ouichefs_inode_kinship {
 	struct inode *parent;
 	struct inode *inode;
+	bool demote;	/* Move the victim to the cold tier */
 };
 
 /* superblock functions */
@@ -100,11 +195,102 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
+void ouichefs_readahead_inodes(struct super_block *sb, const uint32_t *inos,
+			       int nr);
+int ouichefs_remove(struct inode *dir, struct inode *inode,
+		    const struct qstr *name);
+
+/* event functions */
+struct ouichefs_event;
+void ouichefs_event_push(const struct ouichefs_event *ev);
+
+/* ttl functions */
+int ouichefs_ttl_init(struct super_block *sb);
+void ouichefs_ttl_destroy(struct super_block *sb);
+void ouichefs_ttl_queue(struct inode *dir, struct inode *inode);
+void ouichefs_ttl_dequeue(struct inode *inode);
+void ouichefs_ttl_set(struct inode *dir, struct inode *inode, uint32_t ttl);
+
+/* cold tier functions */
+int ouichefs_cold_init(struct super_block *sb, const char *path);
+void ouichefs_cold_destroy(struct super_block *sb);
+int ouichefs_cold_demote(struct inode *dir, struct inode *inode);
+int ouichefs_cold_recall(struct inode *dir, struct inode *inode);
+void ouichefs_cold_release(struct inode *inode);
+
+/* directory entries functions */
+typedef int (*ouichefs_dir_actor_t)(void *data, const char *name,
+				    unsigned int len, uint32_t ino,
+				    unsigned int type);
+u32 ouichefs_dir_hash(const char *name, unsigned int len);
+struct ouichefs_dirent *ouichefs_dirent_get(void *block, unsigned int off);
+/* Iterate over the entries of a leaf, tombstones included */
+#define for_each_dirent(de, block, off)				\
+	for (off = 0; (de = ouichefs_dirent_get(block, off));	\
+	     off += de->rec_len)
+uint32_t ouichefs_dir_leaf_at(struct super_block *sb, uint32_t index_block,
+			      uint32_t flags, unsigned int pos);
+int ouichefs_dir_nr_leaves(struct inode *dir);
+int ouichefs_dir_leaf(struct inode *dir, u32 hash, unsigned int *pos,
+		      uint32_t *bno);
+int ouichefs_dir_leaf_walk(struct super_block *sb, uint32_t bno,
+			   ouichefs_dir_actor_t actor, void *data);
+int ouichefs_dir_walk(struct super_block *sb, uint32_t index_block,
+		      uint32_t flags, ouichefs_dir_actor_t actor, void *data);
+/* End of the readdir positions of a directory, see ouichefs_dir_read() */
+#define OUICHEFS_DIR_POS_END	(1LL << 31)
+int ouichefs_dir_read(struct inode *dir, loff_t *pos,
+		      ouichefs_dir_actor_t actor, void *data);
+int ouichefs_dir_inos(struct super_block *sb, uint32_t index_block,
+		      uint32_t flags, uint32_t **inos);
+int ouichefs_dir_nr_files(struct inode *dir);
+int ouichefs_dir_add(struct inode *dir, const char *name, unsigned int len,
+		     uint32_t ino, unsigned int type);
+int ouichefs_dir_del(struct inode *dir, const char *name, unsigned int len,
+		     uint32_t ino);
+void ouichefs_dir_free_leaves(struct super_block *sb, uint32_t index_block,
+			      uint32_t flags);
+
+/* directory index functions */
+int ouichefs_dir_find(struct inode *dir, const char *name, unsigned int len,
+		      uint32_t *ino);
+int ouichefs_dir_index_off(struct inode *dir, const char *name,
+			   unsigned int len, unsigned int *off);
+unsigned int ouichefs_dir_index_hint(struct inode *dir, unsigned int pos);
+void ouichefs_dir_index_set_hint(struct inode *dir, unsigned int pos,
+				 unsigned int off);
+void ouichefs_dir_index_add(struct inode *dir, const char *name,
+			    unsigned int len, uint32_t ino, unsigned int pos,
+			    unsigned int off);
+void ouichefs_dir_index_move(struct inode *dir, const char *name,
+			     unsigned int len, unsigned int off);
+void ouichefs_dir_index_split(struct inode *dir, unsigned int pos,
+			      unsigned int new_pos);
+void ouichefs_dir_index_del(struct inode *dir, const char *name,
+			    unsigned int len);
+void ouichefs_dir_index_drop(struct inode *dir);
+
+/* orphan functions */
+int ouichefs_orphan_init(struct super_block *sb);
+void ouichefs_orphan_destroy(struct super_block *sb);
+int ouichefs_orphan_add(struct inode *inode);
+void ouichefs_orphan_cancel(struct inode *inode);
+void ouichefs_orphan_release(struct inode *inode);
+void ouichefs_orphan_flush(struct super_block *sb);
+
+/* subtree deletion functions */
+int ouichefs_rmtree_init(struct super_block *sb);
+void ouichefs_rmtree_destroy(struct super_block *sb);
+int ouichefs_rmtree(struct inode *dir, struct dentry *dentry);
 
 /* file functions */
 extern const struct file_operations ouichefs_file_ops;
 extern const struct file_operations ouichefs_dir_ops;
 extern const struct address_space_operations ouichefs_aops;
+void ouichefs_heat_account(struct inode *inode, int write);
+uint32_t ouichefs_heat(struct inode *inode);
+void ouichefs_file_index_put(struct inode *inode);
+bool ouichefs_file_commit(struct inode *inode, bool all);
 
 /* Getters for superbock and inode */
 #define OUICHEFS_SB(sb) (sb->s_fs_info)
@@ -114,11 +300,38 @@ extern const struct address_space_operations ouichefs_aops;
 
 
 extern int (*ouichefs_fblocks_strategy)(struct inode *a, struct inode *b);
+extern int (*ouichefs_fblocks_strategy_bound)(struct inode *victim,
+					      struct ouichefs_dir_summary *sum);
+struct ouichefs_policy;
+extern int ouichefs_fblocks_set_policy(const struct ouichefs_policy *policy);
+extern void ouichefs_fblocks_get_policy(struct ouichefs_policy *policy);
+extern int ouichefs_budget_enforce(struct inode *dir, int blocks,
+				   struct inode *locked);
+extern void ouichefs_summary_update(struct inode *dir, struct inode *inode,
+				    int blocks, int files);
+extern void ouichefs_summary_remove(struct inode *dir, struct inode *inode);
 extern void ouichefs_destroy_inode(struct inode *inode);
-extern int ouichefs_fblocks(struct inode *dir);
+extern int ouichefs_fblocks_init(void);
+extern void ouichefs_fblocks_exit(void);
+extern int ouichefs_fblocks(struct inode *dir, struct inode *locked);
+extern void ouichefs_fblocks_watermark(struct super_block *sb, int blocks,
+				       struct inode *locked);
+extern void ouichefs_fblocks_watermark_work(struct work_struct *work);
+extern void ouichefs_fblocks_kick(struct ouichefs_sb_info *sbi);
+extern void ouichefs_fblocks_stop(struct super_block *sb);
+extern int ouichefs_fblocks_delete(struct inode *dir, struct inode *inode);
+extern bool ouichefs_fblocks_busy(struct inode *inode, int refs);
+extern s64 ouichefs_fblocks_victim_score(struct inode *inode);
+struct ouichefs_candidate;
+extern int ouichefs_fblocks_dry_run(struct inode *dir,
+				    struct ouichefs_candidate *candidates,
+				    unsigned int max);
 #define OUICHEFS_TOTAL_BLOCK(sb) \
 	(sb->nr_blocks - sb->nr_istore_blocks-1)
 #define PERCENTAGE			40
+/* Files are evicted when fewer blocks than this are free */
+#define OUICHEFS_WATERMARK(sb) \
+	(OUICHEFS_TOTAL_BLOCK(sb) * PERCENTAGE / 100)
 extern struct inode *root_inode;
 
 #endif	/* _OUICHEFS_H */
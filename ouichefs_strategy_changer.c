@@ -1,24 +1,55 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/string.h>
 #include "ouichefs.h"
 
 MODULE_DESCRIPTION("Change the strategy of compare.");
 MODULE_LICENSE("GPL");
 
+static char *strategy = "size";
+module_param(strategy, charp, 0444);
+MODULE_PARM_DESC(strategy, "Free blocks strategy: size or heat");
+
 int (*default_strategy)(struct inode *a, struct inode *b) = NULL;
+int (*default_strategy_bound)(struct inode *victim,
+			      struct ouichefs_dir_summary *sum) = NULL;
 
 int ouichefs_strategy_size(struct inode *a, struct inode *b)
 {
 	return b->i_size - a->i_size;
 }
 
+int ouichefs_strategy_size_bound(struct inode *victim,
+				 struct ouichefs_dir_summary *sum)
+{
+	return sum->largest_size - victim->i_size;
+}
+
+/* Le fichier le moins accédé l'emporte, puis le plus vieux */
+int ouichefs_strategy_heat(struct inode *a, struct inode *b)
+{
+	uint32_t heat_a = ouichefs_heat(a), heat_b = ouichefs_heat(b);
+
+	if (heat_a != heat_b)
+		return heat_a > heat_b ? 1 : -1;
+	return a->i_mtime.tv_sec - b->i_mtime.tv_sec;
+}
+
 static int __init ouichefs_strategy_changer_init(void)
 {
 	/* Sauvegarde la stratégie actuelle */
 	default_strategy = ouichefs_fblocks_strategy;
+	default_strategy_bound = ouichefs_fblocks_strategy_bound;
 	/* Attribue notre stratégie */
-	ouichefs_fblocks_strategy = ouichefs_strategy_size;
+	if (!strcmp(strategy, "heat")) {
+		/* Les résumés ne bornent pas la chaleur, pas d'élagage */
+		ouichefs_fblocks_strategy = ouichefs_strategy_heat;
+		ouichefs_fblocks_strategy_bound = NULL;
+	} else {
+		ouichefs_fblocks_strategy = ouichefs_strategy_size;
+		ouichefs_fblocks_strategy_bound = ouichefs_strategy_size_bound;
+	}
 	pr_info("New ouichefs free blocks strategy applied\n");
 
 	return 0;
@@ -29,6 +60,7 @@ static void __exit ouichefs_strategy_changer_exit(void)
 {
 	/* Restaure la stratégie par défaut */
 	ouichefs_fblocks_strategy = default_strategy;
+	ouichefs_fblocks_strategy_bound = default_strategy_bound;
 	pr_info("ouichefs free blocks strategy restored");
 
 }
@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/fsnotify.h>
+
+#include "ouichefs.h"
+
+/*
+ * Deletion of whole subtrees (RMTREE ioctl). The root of the subtree is
+ * removed from its parent right away, so that the subtree disappears at
+ * once. Its files are then unlinked in the background, one directory after
+ * the other: each one goes to the orphan list as with unlink, and is freed
+ * once it is not used anymore. If the partition is unmounted uncleanly in
+ * the middle, the orphan list processing at next mount finishes the job.
+ */
+
+/* A directory whose files are still to be unlinked */
+struct ouichefs_rmtree_dir {
+	struct list_head list;
+	struct inode *dir;	/* Reference held until it is processed */
+};
+
+/* Directories of a partition still to be emptied and their worker */
+struct ouichefs_rmtree_queue {
+	spinlock_t lock;
+	struct list_head dirs;
+	struct work_struct work;
+};
+
+/* Next entry to unlink from a directory */
+struct ouichefs_rmtree_entry {
+	uint32_t ino;
+	unsigned int len;
+	char name[OUICHEFS_FILENAME_LEN];
+};
+
+/*
+ * Queue dir to be emptied, taking over the caller's reference to it.
+ */
+static int rmtree_queue(struct super_block *sb, struct inode *dir)
+{
+	struct ouichefs_rmtree_queue *rmtree = OUICHEFS_SB(sb)->rmtree;
+	struct ouichefs_rmtree_dir *d;
+
+	d = kmalloc(sizeof(*d), GFP_KERNEL);
+	if (!d)
+		return -ENOMEM;
+	d->dir = dir;
+
+	spin_lock(&rmtree->lock);
+	list_add_tail(&d->list, &rmtree->dirs);
+	spin_unlock(&rmtree->lock);
+	queue_work(system_unbound_wq, &rmtree->work);
+
+	return 0;
+}
+
+static int rmtree_actor(void *data, const char *name, unsigned int len,
+			uint32_t ino, unsigned int type)
+{
+	struct ouichefs_rmtree_entry *e = data;
+
+	e->ino = ino;
+	e->len = len;
+	memcpy(e->name, name, len);
+	return 1;
+}
+
+/*
+ * Unlink all the files of the removed directory dir, queuing its
+ * subdirectories to be emptied in turn. Nothing is done on a read-only
+ * partition: dir stays in the orphan list with its files, which are freed at
+ * next mount.
+ */
+static void rmtree_empty(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_rmtree_entry *e;
+	struct dentry *dentry;
+	struct inode *inode;
+	struct qstr name;
+	loff_t pos = 0;
+	int ret;
+
+	e = kmalloc(sizeof(*e), GFP_KERNEL);
+	if (!e)
+		return;
+
+	sb_start_write(sb);
+	if (sb_rdonly(sb))
+		goto end;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	/* Nothing can be created in dir anymore */
+	dir->i_flags |= S_DEAD;
+
+	/* Removed entries are gone when resuming at their position */
+	while (ouichefs_dir_read(dir, &pos, rmtree_actor, e) > 0) {
+		name = (struct qstr)QSTR_INIT(e->name, e->len);
+		inode = ouichefs_iget(sb, e->ino);
+		if (IS_ERR(inode)) {
+			pr_err("cannot remove inode %u\n", e->ino);
+			break;
+		}
+
+		inode_lock_nested(inode, I_MUTEX_CHILD);
+		ret = ouichefs_remove(dir, inode, &name);
+		inode_unlock(inode);
+		if (ret) {
+			pr_err("cannot remove inode %u: %d\n", e->ino, ret);
+			iput(inode);
+			break;
+		}
+		/*
+		 * Let the dcache and fsnotify know, as unlink and rmdir do: a
+		 * dentry in use must not stay hashed on the removed file
+		 */
+		dentry = d_find_alias(inode);
+		if (dentry) {
+			if (S_ISDIR(inode->i_mode)) {
+				d_invalidate(dentry);
+				fsnotify_nameremove(dentry, 1);
+			} else {
+				d_delete(dentry);
+			}
+			dput(dentry);
+		}
+
+		if (!S_ISDIR(inode->i_mode) || rmtree_queue(sb, inode))
+			iput(inode);
+		cond_resched();
+	}
+	inode_unlock(dir);
+
+end:
+	sb_end_write(sb);
+	kfree(e);
+}
+
+static void ouichefs_rmtree_work(struct work_struct *work)
+{
+	struct ouichefs_rmtree_queue *rmtree =
+		container_of(work, struct ouichefs_rmtree_queue, work);
+	struct ouichefs_rmtree_dir *d;
+
+	for (;;) {
+		spin_lock(&rmtree->lock);
+		d = list_first_entry_or_null(&rmtree->dirs,
+					     struct ouichefs_rmtree_dir, list);
+		if (d)
+			list_del(&d->list);
+		spin_unlock(&rmtree->lock);
+		if (!d)
+			return;
+
+		/* Failures leave files in dir, freed at next mount */
+		rmtree_empty(d->dir);
+		iput(d->dir);
+		kfree(d);
+	}
+}
+
+/*
+ * Remove the directory dentry, and all its subtree, from dir. Only the
+ * directory itself is removed synchronously, its files are unlinked in the
+ * background. Must be called with dir locked.
+ */
+int ouichefs_rmtree(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	int ret;
+
+	if (!OUICHEFS_SB(dir->i_sb)->rmtree)
+		return -EOPNOTSUPP;
+	if (!igrab(inode))
+		return -ENOENT;
+
+	/* Get rid of the unused dentries of the subtree first, like rmdir */
+	shrink_dcache_parent(dentry);
+
+	inode_lock_nested(inode, I_MUTEX_CHILD);
+	ret = ouichefs_remove(dir, inode, &dentry->d_name);
+	if (!ret) {
+		ouichefs_summary_remove(dir, inode);
+		inode->i_flags |= S_DEAD;
+		dont_mount(dentry);
+	}
+	inode_unlock(inode);
+	if (ret) {
+		iput(inode);
+		return ret;
+	}
+	d_delete(dentry);
+
+	if (rmtree_queue(dir->i_sb, inode)) {
+		pr_err("cannot empty inode %lu, done at next mount\n",
+		       inode->i_ino);
+		iput(inode);
+	}
+
+	return 0;
+}
+
+/*
+ * Set up the background deletion of subtrees of sb.
+ */
+int ouichefs_rmtree_init(struct super_block *sb)
+{
+	struct ouichefs_rmtree_queue *rmtree;
+
+	rmtree = kzalloc(sizeof(*rmtree), GFP_KERNEL);
+	if (!rmtree)
+		return -ENOMEM;
+	spin_lock_init(&rmtree->lock);
+	INIT_LIST_HEAD(&rmtree->dirs);
+	INIT_WORK(&rmtree->work, ouichefs_rmtree_work);
+	OUICHEFS_SB(sb)->rmtree = rmtree;
+
+	return 0;
+}
+
+/*
+ * Finish the pending subtree deletions of sb: the directories being emptied
+ * hold inode references, which must be dropped before umount.
+ */
+void ouichefs_rmtree_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_rmtree_queue *rmtree;
+
+	if (!sbi || !sbi->rmtree)
+		return;
+	rmtree = sbi->rmtree;
+
+	flush_work(&rmtree->work);
+	sbi->rmtree = NULL;
+	kfree(rmtree);
+}
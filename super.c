@@ -10,6 +10,7 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
 
@@ -43,14 +44,33 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	if (!ci)
 		return NULL;
 	inode_init_once(&ci->vfs_inode);
+	atomic_set(&ci->nr_open, 0);
+	ci->close_stamp = 0;
+	ci->dir_index = NULL;
+	ci->index_bh = NULL;
+	ci->pending = NULL;
 	return &ci->vfs_inode;
 }
 
+/*
+ * The last reference to inode is dropped. Unlinked inodes are orphans: their
+ * blocks are freed in the background.
+ */
+static void ouichefs_evict_inode(struct inode *inode)
+{
+	truncate_inode_pages_final(&inode->i_data);
+	ouichefs_file_index_put(inode);
+	clear_inode(inode);
+	if (!inode->i_nlink)
+		ouichefs_orphan_release(inode);
+}
+
 void ouichefs_destroy_inode(struct inode *inode)
 {
 	struct ouichefs_inode_info *ci;
 
 	ci = OUICHEFS_INODE(inode);
+	ouichefs_dir_index_drop(inode);
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
@@ -69,6 +89,14 @@ static int ouichefs_write_inode(struct inode *inode,
 	if (ino >= sbi->nr_inodes)
 		return 0;
 
+	/* New blocks enter the index once their page is written back */
+	if (S_ISREG(inode->i_mode)) {
+		if (wbc->sync_mode == WB_SYNC_ALL)
+			filemap_fdatawait(inode->i_mapping);
+		if (ouichefs_file_commit(inode, false))
+			mark_inode_dirty(inode);
+	}
+
 	bh = sb_bread(sb, inode_block);
 	if (!bh)
 		return -EIO;
@@ -76,19 +104,32 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode += inode_shift;
 
 	/* update the mode using what the generic inode has */
-	disk_inode->i_mode      = inode->i_mode;
-	disk_inode->i_uid       = i_uid_read(inode);
-	disk_inode->i_gid       = i_gid_read(inode);
-	disk_inode->i_size      = inode->i_size;
-	disk_inode->i_ctime     = inode->i_ctime.tv_sec;
-	disk_inode->i_atime     = inode->i_atime.tv_sec;
-	disk_inode->i_mtime     = inode->i_mtime.tv_sec;
-	disk_inode->i_blocks    = inode->i_blocks;
-	disk_inode->i_nlink     = inode->i_nlink;
-	disk_inode->index_block = ci->index_block;
+	disk_inode->i_mode       = inode->i_mode;
+	disk_inode->i_uid        = i_uid_read(inode);
+	disk_inode->i_gid        = i_gid_read(inode);
+	disk_inode->i_size       = inode->i_size;
+	disk_inode->i_ctime      = inode->i_ctime.tv_sec;
+	disk_inode->i_atime      = inode->i_atime.tv_sec;
+	disk_inode->i_mtime      = inode->i_mtime.tv_sec;
+	disk_inode->i_blocks     = inode->i_blocks;
+	disk_inode->i_nlink      = inode->i_nlink;
+	disk_inode->index_block  = ci->index_block;
+	disk_inode->i_sum_mtime  = ci->summary.oldest_mtime;
+	disk_inode->i_sum_size   = ci->summary.largest_size;
+	disk_inode->i_sum_blocks = ci->summary.nr_blocks;
+	disk_inode->i_sum_files  = ci->summary.nr_files;
+	disk_inode->i_heat_read  = ci->heat_read;
+	disk_inode->i_heat_write = ci->heat_write;
+	disk_inode->i_heat_stamp = ci->heat_stamp;
+	disk_inode->i_budget     = ci->budget;
+	disk_inode->i_ttl        = ci->ttl;
+	disk_inode->i_flags      = ci->flags;
+	disk_inode->i_cold_slot  = ci->cold_slot;
 
 	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	/* Background writeback leaves the block to the buffer cache flusher */
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		sync_dirty_buffer(bh);
 	brelse(bh);
 
 	return 0;
@@ -113,6 +154,7 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	disk_sb->nr_bfree_blocks  = sbi->nr_bfree_blocks;
 	disk_sb->nr_free_inodes   = sbi->nr_free_inodes;
 	disk_sb->nr_free_blocks   = sbi->nr_free_blocks;
+	disk_sb->orphan_head      = sbi->orphan_head;
 
 	mark_buffer_dirty(bh);
 	if (wait)
@@ -176,17 +218,6 @@ static int sync_bfree(struct super_block *sb, int wait)
 	return 0;
 }
 
-static void ouichefs_put_super(struct super_block *sb)
-{
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-
-	if (sbi) {
-		kfree(sbi->ifree_bitmap);
-		kfree(sbi->bfree_bitmap);
-		kfree(sbi);
-	}
-}
-
 static int ouichefs_sync_fs(struct super_block *sb, int wait)
 {
 	int ret = 0;
@@ -204,6 +235,21 @@ static int ouichefs_sync_fs(struct super_block *sb, int wait)
 	return 0;
 }
 
+static void ouichefs_put_super(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (sbi) {
+		/* The orphans released by umount were freed after the last sync */
+		ouichefs_orphan_destroy(sb);
+		ouichefs_sync_fs(sb, 1);
+		ouichefs_cold_destroy(sb);
+		kfree(sbi->ifree_bitmap);
+		kfree(sbi->bfree_bitmap);
+		kfree(sbi);
+	}
+}
+
 static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 {
 	struct super_block *sb = dentry->d_sb;
@@ -226,18 +272,51 @@ static struct super_operations ouichefs_super_ops = {
 	.alloc_inode   = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
 	.write_inode   = ouichefs_write_inode,
+	.evict_inode   = ouichefs_evict_inode,
 	.sync_fs       = ouichefs_sync_fs,
 	.statfs        = ouichefs_statfs,
 };
 
+/*
+ * Parse the mount options:
+ *   cold=<path>: file or block device receiving the evicted files
+ *   discard: discard the blocks of deleted files
+ */
+static int ouichefs_parse_options(char *options, char **cold_path,
+				  bool *discard)
+{
+	char *p;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		if (!strncmp(p, "cold=", 5) && p[5]) {
+			*cold_path = p + 5;
+		} else if (!strcmp(p, "discard")) {
+			*discard = true;
+		} else {
+			pr_err("unknown mount option '%s'\n", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
 /* Fill the struct superblock from partition superblock */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head *bh = NULL;
 	struct ouichefs_sb_info *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
+	char *cold_path = NULL;
+	bool discard = false;
 	int ret = 0, i;
 
+	ret = ouichefs_parse_options(data, &cold_path, &discard);
+	if (ret)
+		return ret;
+
 	/* Init sb */
 	sb->s_magic = OUICHEFS_MAGIC;
 	sb_set_blocksize(sb, OUICHEFS_BLOCK_SIZE);
@@ -257,6 +336,14 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto release;
 	}
 
+	/* Check the on-disk format version */
+	if (csb->version != OUICHEFS_VERSION) {
+		pr_err("Unsupported format version %u (expected %u), run mkfs again\n",
+		       csb->version, OUICHEFS_VERSION);
+		ret = -EINVAL;
+		goto release;
+	}
+
 	/* Alloc sb_info */
 	sbi = kzalloc(sizeof(struct ouichefs_sb_info), GFP_KERNEL);
 	if (!sbi) {
@@ -270,6 +357,15 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
 	sbi->nr_free_inodes = csb->nr_free_inodes;
 	sbi->nr_free_blocks = csb->nr_free_blocks;
+	sbi->orphan_head = csb->orphan_head;
+	sbi->discard = discard;
+	if (discard && !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		pr_warn("discard not supported by the device\n");
+		sbi->discard = false;
+	}
+	spin_lock_init(&sbi->bitmap_lock);
+	sbi->sb = sb;
+	INIT_WORK(&sbi->watermark_work, ouichefs_fblocks_watermark_work);
 	sb->s_fs_info = sbi;
 
 	brelse(bh);
@@ -318,11 +414,21 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		brelse(bh);
 	}
 
+	/* Free the files unlinked before the last umount or crash */
+	ret = ouichefs_orphan_init(sb);
+	if (ret)
+		goto free_bfree;
+
+	/* Attach the cold tier */
+	ret = ouichefs_cold_init(sb, cold_path);
+	if (ret)
+		goto put_orphans;
+
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 0);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto free_bfree;
+		goto put_cold;
 	}
 	inode_init_owner(root_inode, NULL, root_inode->i_mode);
 	sb->s_root = d_make_root(root_inode);
@@ -331,15 +437,28 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto iput;
 	}
 
+	/* Start the reaper of expired files, the fs can live without it */
+	if (ouichefs_ttl_init(sb))
+		pr_warn("TTL reaper disabled\n");
+
+	/* Same for the background deletion of subtrees */
+	if (ouichefs_rmtree_init(sb))
+		pr_warn("subtree deletion disabled\n");
+
 	return 0;
 
 iput:
 	iput(root_inode);
+put_cold:
+	ouichefs_cold_destroy(sb);
+put_orphans:
+	ouichefs_orphan_destroy(sb);
 free_bfree:
 	kfree(sbi->bfree_bitmap);
 free_ifree:
 	kfree(sbi->ifree_bitmap);
 free_sbi:
+	sb->s_fs_info = NULL;
 	kfree(sbi);
 release:
 	brelse(bh);
@@ -0,0 +1,433 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+
+#include "ouichefs.h"
+#include "ioctl_ouichefs.h"
+
+#define OUICHEFS_TTL_HASH_BITS	8
+#define OUICHEFS_TTL_BATCH	32	/* Max files unlinked per reaper run */
+#define OUICHEFS_TTL_MAX_DELAY	3600	/* Max seconds between two runs */
+
+/*
+ * A file with a TTL, waiting in the expiry queue. expiry may be earlier than
+ * the real expiry of the file if it was written since it was queued: the
+ * reaper checks the inode again before unlinking it.
+ */
+struct ouichefs_ttl_entry {
+	struct rb_node node;	/* In the queue, sorted by expiry */
+	struct hlist_node hash;	/* In the hash table, by ino */
+	uint32_t ino;
+	uint32_t parent;	/* Directory containing ino */
+	time64_t expiry;
+};
+
+/* Expiry queue of a partition and its reaper */
+struct ouichefs_ttl {
+	struct super_block *sb;
+	spinlock_t lock;
+	struct rb_root queue;
+	DECLARE_HASHTABLE(hash, OUICHEFS_TTL_HASH_BITS);
+	struct delayed_work work;
+};
+
+static struct ouichefs_ttl_entry *ttl_find(struct ouichefs_ttl *ttl,
+					   uint32_t ino)
+{
+	struct ouichefs_ttl_entry *e;
+
+	hash_for_each_possible(ttl->hash, e, hash, ino)
+		if (e->ino == ino)
+			return e;
+	return NULL;
+}
+
+static void ttl_insert(struct ouichefs_ttl *ttl, struct ouichefs_ttl_entry *e)
+{
+	struct rb_node **p = &ttl->queue.rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (e->expiry < rb_entry(parent, struct ouichefs_ttl_entry,
+					 node)->expiry)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&e->node, parent, p);
+	rb_insert_color(&e->node, &ttl->queue);
+}
+
+/*
+ * Schedule the reaper for the first expiry of the queue. Must be called with
+ * ttl->lock held.
+ */
+static void ttl_schedule(struct ouichefs_ttl *ttl)
+{
+	struct rb_node *first = rb_first(&ttl->queue);
+	time64_t now = ktime_get_real_seconds(), delay;
+
+	if (!first)
+		return;
+	delay = rb_entry(first, struct ouichefs_ttl_entry, node)->expiry - now;
+	delay = clamp_t(time64_t, delay, 0, OUICHEFS_TTL_MAX_DELAY);
+	mod_delayed_work(system_wq, &ttl->work, delay * HZ);
+}
+
+/*
+ * Queue ino to expire at expiry, or move it if it is already queued.
+ */
+static int ttl_update(struct ouichefs_ttl *ttl, uint32_t ino, uint32_t parent,
+		      time64_t expiry)
+{
+	struct ouichefs_ttl_entry *e, *new;
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	spin_lock(&ttl->lock);
+	e = ttl_find(ttl, ino);
+	if (e) {
+		rb_erase(&e->node, &ttl->queue);
+	} else {
+		e = new;
+		new = NULL;
+		e->ino = ino;
+		hash_add(ttl->hash, &e->hash, ino);
+	}
+	e->parent = parent;
+	e->expiry = expiry;
+	ttl_insert(ttl, e);
+	ttl_schedule(ttl);
+	spin_unlock(&ttl->lock);
+
+	kfree(new);
+	return 0;
+}
+
+static void ttl_remove(struct ouichefs_ttl *ttl, uint32_t ino)
+{
+	struct ouichefs_ttl_entry *e;
+
+	spin_lock(&ttl->lock);
+	e = ttl_find(ttl, ino);
+	if (e) {
+		rb_erase(&e->node, &ttl->queue);
+		hash_del(&e->hash);
+	}
+	spin_unlock(&ttl->lock);
+
+	kfree(e);
+}
+
+/*
+ * Queue inode, contained in dir, according to its TTL and mtime. Files
+ * without TTL are removed from the queue.
+ */
+void ouichefs_ttl_queue(struct inode *dir, struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	if (!sbi->ttl)
+		return;
+	if (!S_ISREG(inode->i_mode) || !ci->ttl) {
+		ttl_remove(sbi->ttl, inode->i_ino);
+		return;
+	}
+	if (ttl_update(sbi->ttl, inode->i_ino, dir->i_ino,
+		       inode->i_mtime.tv_sec + ci->ttl))
+		pr_warn("inode %lu not queued for expiry\n", inode->i_ino);
+}
+
+/*
+ * Remove inode from the expiry queue.
+ */
+void ouichefs_ttl_dequeue(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+
+	if (sbi->ttl)
+		ttl_remove(sbi->ttl, inode->i_ino);
+}
+
+/*
+ * Set the TTL of inode, contained in dir. For a directory, this is the TTL
+ * inherited by the files created in it afterwards.
+ */
+void ouichefs_ttl_set(struct inode *dir, struct inode *inode, uint32_t ttl)
+{
+	OUICHEFS_INODE(inode)->ttl = ttl;
+	mark_inode_dirty(inode);
+	ouichefs_ttl_queue(dir, inode);
+}
+
+/*
+ * Unlink file ino from directory parent if it has expired.
+ */
+static void ttl_expire(struct ouichefs_ttl *ttl, uint32_t ino,
+		       uint32_t parent, time64_t now)
+{
+	struct super_block *sb = ttl->sb;
+	struct inode *inode, *dir;
+	struct ouichefs_inode_info *ci;
+	struct ouichefs_event ev = { .reason = OUICHEFS_EVENT_EXPIRE };
+	u64 start = ktime_get_ns();
+	time64_t expiry;
+
+	inode = ouichefs_iget(sb, ino);
+	if (IS_ERR(inode))
+		return;
+	ci = OUICHEFS_INODE(inode);
+	/* Pinned files are queued again when unpinned */
+	if (!S_ISREG(inode->i_mode) || !ci->ttl ||
+	    (ci->flags & OUICHEFS_FL_PINNED))
+		goto iput;
+
+	/* Written since it was queued, or in use: try again later */
+	expiry = inode->i_mtime.tv_sec + ci->ttl;
+	if (expiry > now || ouichefs_fblocks_busy(inode, 1)) {
+		ttl_update(ttl, ino, parent, max(expiry, now + 60));
+		goto iput;
+	}
+
+	/* Frozen or read-only partition: try again later */
+	if (sb_rdonly(sb) || !sb_start_write_trylock(sb)) {
+		ttl_update(ttl, ino, parent, now + 60);
+		goto iput;
+	}
+
+	dir = ouichefs_iget(sb, parent);
+	if (IS_ERR(dir)) {
+		sb_end_write(sb);
+		goto iput;
+	}
+	ev.ino = ino;
+	ev.parent = parent;
+	ev.size = inode->i_size;
+	ev.age = now - inode->i_mtime.tv_sec;
+	ev.score = ouichefs_fblocks_victim_score(inode);
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	if (!ouichefs_fblocks_delete(dir, inode)) {
+		pr_info("inode %u expired\n", ino);
+		ev.latency_ns = ktime_get_ns() - start;
+		ouichefs_event_push(&ev);
+	}
+	inode_unlock(dir);
+	iput(dir);
+	sb_end_write(sb);
+	iput(inode);
+
+	/* Free the blocks now, so that allocations see them right away */
+	ouichefs_orphan_flush(sb);
+	return;
+iput:
+	iput(inode);
+}
+
+/*
+ * Reaper: unlink the expired files at the head of the queue, at most
+ * OUICHEFS_TTL_BATCH of them per run, then schedule the next run.
+ */
+static void ouichefs_ttl_reap(struct work_struct *work)
+{
+	struct ouichefs_ttl *ttl = container_of(to_delayed_work(work),
+						struct ouichefs_ttl, work);
+	struct ouichefs_ttl_entry *e;
+	struct rb_node *first;
+	time64_t now = ktime_get_real_seconds();
+	uint32_t ino, parent;
+	int i;
+
+	/* Nothing can be unlinked on a read-only partition, check again later */
+	if (sb_rdonly(ttl->sb)) {
+		mod_delayed_work(system_wq, &ttl->work,
+				 OUICHEFS_TTL_MAX_DELAY * HZ);
+		return;
+	}
+
+	for (i = 0; i < OUICHEFS_TTL_BATCH; i++) {
+		spin_lock(&ttl->lock);
+		first = rb_first(&ttl->queue);
+		e = first ? rb_entry(first, struct ouichefs_ttl_entry, node)
+			  : NULL;
+		if (!e || e->expiry > now) {
+			spin_unlock(&ttl->lock);
+			break;
+		}
+		rb_erase(&e->node, &ttl->queue);
+		hash_del(&e->hash);
+		spin_unlock(&ttl->lock);
+
+		ino = e->ino;
+		parent = e->parent;
+		kfree(e);
+		ttl_expire(ttl, ino, parent, now);
+	}
+
+	spin_lock(&ttl->lock);
+	ttl_schedule(ttl);
+	spin_unlock(&ttl->lock);
+}
+
+/* A directory waiting to be scanned by ttl_scan() */
+struct ouichefs_ttl_dir {
+	struct list_head list;
+	uint32_t ino;
+	uint32_t index_block;
+	uint32_t flags;
+};
+
+static int ttl_scan_push(struct list_head *dirs, uint32_t ino,
+			 uint32_t index_block, uint32_t flags)
+{
+	struct ouichefs_ttl_dir *d;
+
+	d = kmalloc(sizeof(*d), GFP_KERNEL);
+	if (!d)
+		return -ENOMEM;
+	d->ino = ino;
+	d->index_block = index_block;
+	d->flags = flags;
+	list_add_tail(&d->list, dirs);
+	return 0;
+}
+
+/*
+ * Queue the files with a TTL in directory d, and add its subdirectories to
+ * dirs, reading the directory and inode blocks directly to avoid loading
+ * every inode.
+ */
+static int ttl_scan_dir(struct ouichefs_ttl *ttl, struct ouichefs_ttl_dir *d,
+			struct list_head *dirs)
+{
+	struct super_block *sb = ttl->sb;
+	struct buffer_head *bh;
+	struct ouichefs_inode *cinode;
+	uint32_t *inos;
+	uint32_t ino, mode, idx, iflags, ttl_sec, mtime;
+	int i, nr, ret = 0;
+
+	nr = ouichefs_dir_inos(sb, d->index_block, d->flags, &inos);
+	if (nr < 0)
+		return nr;
+	ouichefs_readahead_inodes(sb, inos, nr);
+
+	for (i = 0; i < nr && !ret; i++) {
+		ino = inos[i];
+
+		bh = sb_bread(sb, ino / OUICHEFS_INODES_PER_BLOCK + 1);
+		if (!bh) {
+			ret = -EIO;
+			break;
+		}
+		cinode = (struct ouichefs_inode *)bh->b_data;
+		cinode += ino % OUICHEFS_INODES_PER_BLOCK;
+		mode = le32_to_cpu(cinode->i_mode);
+		idx = le32_to_cpu(cinode->index_block);
+		iflags = le32_to_cpu(cinode->i_flags);
+		ttl_sec = le32_to_cpu(cinode->i_ttl);
+		mtime = le32_to_cpu(cinode->i_mtime);
+		brelse(bh);
+
+		if (S_ISDIR(mode))
+			ret = ttl_scan_push(dirs, ino, idx, iflags);
+		else if (S_ISREG(mode) && ttl_sec)
+			ret = ttl_update(ttl, ino, d->ino,
+					 (time64_t)mtime + ttl_sec);
+	}
+	kvfree(inos);
+
+	return ret;
+}
+
+/*
+ * Queue all files with a TTL below directory dir_ino. Directories are
+ * scanned one after the other from a list rather than recursively, so that
+ * a deep tree cannot overflow the kernel stack.
+ */
+static int ttl_scan(struct ouichefs_ttl *ttl, uint32_t dir_ino,
+		    uint32_t index_block, uint32_t flags)
+{
+	struct ouichefs_ttl_dir *d, *tmp;
+	LIST_HEAD(dirs);
+	int ret;
+
+	ret = ttl_scan_push(&dirs, dir_ino, index_block, flags);
+	while (!ret && !list_empty(&dirs)) {
+		d = list_first_entry(&dirs, struct ouichefs_ttl_dir, list);
+		list_del(&d->list);
+		ret = ttl_scan_dir(ttl, d, &dirs);
+		kfree(d);
+	}
+	list_for_each_entry_safe(d, tmp, &dirs, list)
+		kfree(d);
+
+	return ret;
+}
+
+/*
+ * Build the expiry queue of sb and start its reaper. On failure, files will
+ * only be removed by the eviction of ouichefs_fblocks().
+ */
+int ouichefs_ttl_init(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_ttl *ttl;
+	int ret;
+
+	ttl = kzalloc(sizeof(*ttl), GFP_KERNEL);
+	if (!ttl)
+		return -ENOMEM;
+	ttl->sb = sb;
+	spin_lock_init(&ttl->lock);
+	ttl->queue = RB_ROOT;
+	hash_init(ttl->hash);
+	INIT_DELAYED_WORK(&ttl->work, ouichefs_ttl_reap);
+
+	ret = ttl_scan(ttl, 0,
+		       OUICHEFS_INODE(d_inode(sb->s_root))->index_block,
+		       OUICHEFS_INODE(d_inode(sb->s_root))->flags);
+	sbi->ttl = ttl;
+	if (ret) {
+		ouichefs_ttl_destroy(sb);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Stop the reaper of sb and free its queue.
+ */
+void ouichefs_ttl_destroy(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_ttl *ttl;
+	struct ouichefs_ttl_entry *e, *tmp;
+
+	if (!sbi || !sbi->ttl)
+		return;
+	ttl = sbi->ttl;
+	sbi->ttl = NULL;
+
+	cancel_delayed_work_sync(&ttl->work);
+	rbtree_postorder_for_each_entry_safe(e, tmp, &ttl->queue, node)
+		kfree(e);
+	kfree(ttl);
+}